@@ -0,0 +1,305 @@
+#ifndef BRAINFUCK_ADT_H
+#define BRAINFUCK_ADT_H
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "brainfuck.h"
+#include "io.h"
+#include "scan.h"
+#include "tape.h"
+
+// The "ADT" version: operations are enums, and the program is a tree
+// of Expression values (see brainfuck-adt.cpp for its main), allocated
+// in an arena like the OOP one. It gets its program from the same front
+// end as the other engines (the PassManager in passes.h), and lowers
+// the resulting IR into its own tree, which it runs with a switch
+// instead of virtual calls. It lives in its own namespace, since most
+// of its names are also taken by the OOP classes in brainfuck.h.
+namespace adt {
+
+enum class Operation {
+    Inc,
+    Dec,
+    Fwd,
+    Bwd,
+    Input,
+    Output,
+    Loop,
+    ScanLeft,
+    ScanRight,
+    SetZero,
+    MulAdd
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Operation& op)
+{
+    switch(op) {
+        case Operation::Inc:    os << "<Inc>"; break;
+        case Operation::Dec:    os << "<Dec>"; break;
+        case Operation::Fwd:    os << "<Fwd>"; break;
+        case Operation::Bwd:    os << "<Bwd>"; break;
+        case Operation::Input:  os << "<Input>"; break;
+        case Operation::Output: os << "<Output>"; break;
+        case Operation::Loop:   os << "<Loop>"; break;
+        case Operation::ScanLeft:  os << "<ScanLeft>"; break;
+        case Operation::ScanRight: os << "<ScanRight>"; break;
+        case Operation::SetZero:   os << "<SetZero>"; break;
+        case Operation::MulAdd:    os << "<MulAdd>"; break;
+    }
+    return os;
+}
+
+class Expression;
+
+// The children of a loop (or the top level of a program): a range of
+// contiguous nodes, allocated in the arena of the Program.
+class Expressions
+{
+private:
+    const Expression* begin_;
+    size_t size_;
+
+public:
+    Expressions() : begin_(nullptr), size_(0) {}
+    Expressions(const Expression* begin, size_t size)
+     : begin_(begin), size_(size) {}
+
+    const Expression* begin() const {return begin_;}
+    const Expression* end() const;
+    size_t size() const {return size_;}
+    bool empty() const {return size_ == 0;}
+
+    const Expression& operator[](size_t i) const;
+};
+
+// A plain value (its children are just a range in the arena), so it
+// can be copied around and never needs to be destroyed. The argument
+// is the amount of Inc/Dec and Fwd/Bwd, the stride of the scans and
+// the offset of the target of MulAdd, and 'at' is the cell the
+// operation works on, relative to the pointer (see OffsetFolder):
+class Expression
+{
+private:
+    Operation op_;
+    ssize_t arg_;
+    ssize_t at_;
+    ssize_t factor_;
+    Expressions children_;
+
+public:
+    Expression(Operation op, Expressions children)
+     : op_(op),
+       arg_(0),
+       at_(0),
+       factor_(0),
+       children_(children) {}
+
+    Expression(Operation op, ssize_t arg=1, ssize_t at=0, ssize_t factor=0)
+     : op_(op),
+       arg_(arg),
+       at_(at),
+       factor_(factor),
+       children_() {}
+
+    inline       Operation operation() const {return op_;}
+    inline         ssize_t argument() const {return arg_;}
+    inline         ssize_t at() const {return at_;}
+    inline         ssize_t factor() const {return factor_;}
+    inline const Expressions& children() const {return children_;}
+
+    friend std::ostream& operator<<(std::ostream& os, const Expression& exp);
+};
+
+inline const Expression* Expressions::end() const {return begin_ + size_;}
+inline const Expression& Expressions::operator[](size_t i) const {return begin_[i];}
+
+inline std::ostream& operator<<(std::ostream& os, const Expressions& expressions)
+{
+    os << "[";
+    for (size_t i = 0; i < expressions.size(); ++i) {
+        os << (i ? ", " : "") << expressions[i];
+    }
+    return os << "]";
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Expression& exp)
+{
+    os << "E(" << exp.op_ << "(" << exp.arg_;
+    if (exp.at_) os << "@" << exp.at_;
+    if (exp.factor_) os << "*" << exp.factor_;
+    os << ")->" << exp.children_
+       << ")";
+    return os;
+}
+
+using ExpressionVector = std::vector<Expression>;
+
+// The whole tree, in an Arena (see brainfuck.h): releasing it is just
+// freeing the arena blocks.
+class Program
+{
+private:
+    Arena arena_;
+    Expressions expressions_;
+
+public:
+    Program() = default;
+    ~Program() = default;
+
+    Program(const Program&) = delete;
+    Program(Program&&) = default;
+    Program& operator=(Program&&) = default;
+
+    // Moves the nodes from 'start' to the end of 'pending' into a new
+    // list (the lists are all built on top of the same vector, as in
+    // ::Program::list()):
+    Expressions list(ExpressionVector& pending, size_t start) {
+        size_t size = pending.size() - start;
+        auto nodes = static_cast<Expression*>(
+            arena_.allocate(size * sizeof(Expression), alignof(Expression))
+        );
+        std::uninitialized_copy(pending.begin() + start, pending.end(), nodes);
+        pending.erase(pending.begin() + start, pending.end());
+        return Expressions(nodes, size);
+    }
+
+    const Expressions& expressions() const {return expressions_;}
+    void expressions(Expressions expressions) {expressions_ = expressions;}
+};
+
+// Turns each node of the IR (after whatever passes ran on it) into the
+// operation that does the same:
+class Lowering : public ExpressionVisitor
+{
+private:
+    Program& program_;
+    ExpressionVector pending_;
+
+    void push(Operation op, ssize_t arg, ssize_t at=0, ssize_t factor=0) {
+        pending_.push_back(Expression(op, arg, at, factor));
+    }
+
+public:
+    Lowering(Program& program) : program_(program) {}
+
+    Expressions lower(const ExpressionList& expressions) {
+        size_t start = pending_.size();
+        for (auto expression: expressions) {
+            expression->accept(*this);
+        }
+        return program_.list(pending_, start);
+    }
+
+    virtual void visit(const Increment& inc) {push(Operation::Inc, inc.offset(), inc.at());}
+    virtual void visit(const Decrement& dec) {push(Operation::Dec, dec.offset(), dec.at());}
+    virtual void visit(const Forward& fwd)   {push(Operation::Fwd, fwd.offset());}
+    virtual void visit(const Backward& bwd)  {push(Operation::Bwd, bwd.offset());}
+    virtual void visit(const Input& input)   {push(Operation::Input, 1, input.at());}
+    virtual void visit(const Output& output) {push(Operation::Output, 1, output.at());}
+    virtual void visit(const SetZero& zero)  {push(Operation::SetZero, 0, zero.at());}
+    virtual void visit(const ScanLeft& scan)  {push(Operation::ScanLeft, scan.stride());}
+    virtual void visit(const ScanRight& scan) {push(Operation::ScanRight, scan.stride());}
+    virtual void visit(const MulAdd& muladd) {
+        push(Operation::MulAdd, muladd.offset(), muladd.at(), muladd.factor());
+    }
+    virtual void visit(const Loop& loop) {
+        Expressions children = lower(loop.children());
+        pending_.push_back(Expression(Operation::Loop, children));
+    }
+};
+
+inline Program lower(const ::Program& source) {
+    Program program;
+    program.expressions(Lowering(program).lower(source.expressions()));
+    return program;
+}
+
+class Memory
+{
+    Tape tape_;
+    unsigned int* ptr_;
+
+public:
+    Memory() : tape_(30000 * sizeof(unsigned int)), ptr_(tape_.begin<unsigned int>()) {}
+    ~Memory() = default;
+
+    void restore(const Prefix& prefix) {ptr_ = prefix.restore(tape_.begin<unsigned int>());}
+
+    inline void inc(unsigned int offset, ssize_t at) { this->ptr_[at] += offset; }
+    inline void dec(unsigned int offset, ssize_t at) { this->ptr_[at] -= offset; }
+    inline void fwd(unsigned int offset) {  this->ptr_ += offset; }
+    inline void bwd(unsigned int offset) {  this->ptr_ -= offset; }
+
+    inline void scan_fwd(unsigned int stride) {
+        this->ptr_ = ::scan_fwd(this->ptr_, tape_.end<unsigned int>(), stride);
+    }
+    inline void scan_bwd(unsigned int stride) {
+        this->ptr_ = ::scan_bwd(this->ptr_, tape_.begin<unsigned int>(), stride);
+    }
+
+    inline void clear(ssize_t at) { this->ptr_[at] = 0; }
+    inline void muladd(ssize_t offset, unsigned int factor, ssize_t at) {
+        this->ptr_[at + offset] += this->ptr_[at] * factor;
+    }
+
+    inline unsigned int read(ssize_t at = 0) {
+        return this->ptr_[at];
+    }
+    inline void write(unsigned int c, ssize_t at) {
+        this->ptr_[at] = c;
+    }
+};
+
+inline void do_run(const Expressions& expressions, Memory &memory, IOContext &io) {
+    for(const auto &expression: expressions) {
+        switch(expression.operation()) {
+            case Operation::Inc: memory.inc(expression.argument(), expression.at()); break;
+            case Operation::Dec: memory.dec(expression.argument(), expression.at()); break;
+            case Operation::Fwd: memory.fwd(expression.argument()); break;
+            case Operation::Bwd: memory.bwd(expression.argument()); break;
+            case Operation::Input: {
+                    int c;
+                    if (io.read(c))
+                        memory.write(c, expression.at());
+                }
+                break;
+            case Operation::Output:
+                io.write(memory.read(expression.at()));
+                break;
+            case Operation::Loop:
+                while(memory.read() > 0) {
+                    do_run(expression.children(), memory, io);
+                }
+                break;
+            case Operation::ScanLeft:  memory.scan_bwd(expression.argument()); break;
+            case Operation::ScanRight: memory.scan_fwd(expression.argument()); break;
+            case Operation::SetZero:   memory.clear(expression.at()); break;
+            case Operation::MulAdd:
+                memory.muladd(expression.argument(), expression.factor(), expression.at());
+                break;
+        }
+    }
+}
+
+// Starts from the state the PartialEvaluator left (see brainfuck.h),
+// as the other engines do:
+inline void run(const Expressions& expressions, const Prefix& prefix, IOPolicy policy,
+                int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO) {
+    Memory memory;
+    IOContext io(policy, in_fd, out_fd);
+
+    io.write(prefix.output.data(), prefix.output.size());
+    memory.restore(prefix);
+
+    try {
+        do_run(expressions, memory, io);
+    } catch (const EndOfInput&) {
+        // The input is over, and so is the program
+    }
+}
+
+} // namespace adt
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef BRAINFUCK_BATCH_H
+#define BRAINFUCK_BATCH_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jit.h"
+
+// Runs the same compiled program over many inputs at once, on a number
+// of threads. The code is only read, so all the threads share it, and
+// each input gets its own tape and I/O buffers, reading from its file
+// and writing to its own output:
+//
+// - With an output directory, to a file named after the input (with
+//   '.out' added). Two inputs with the same name (from different
+//   directories) would write to the same file, so they're rejected.
+// - Otherwise to stdout, in the order of the inputs: each one writes
+//   to an unlinked temporary file, copied out once all the ones before
+//   it are done.
+//
+// The inputs are split evenly between the workers up front, and a
+// worker that runs out of them takes the last one of the worker with
+// the most left, so a few long inputs don't leave the others idle.
+class BatchRunner
+{
+private:
+    struct Job {
+        std::string input;
+        std::string name;   // (of the output file)
+        int out_fd = -1;
+        bool done = false;
+        bool ok = false;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    JITProgram::Code code_ = nullptr;
+    size_t cell_;
+    IOPolicy policy_;
+    std::string output_dir_;
+
+    std::vector<Job> jobs_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+
+    std::mutex mutex_;
+    std::condition_variable done_;
+
+public:
+    BatchRunner(size_t cell, IOPolicy policy, std::string output_dir = "")
+     : cell_(cell), policy_(policy), output_dir_(output_dir) {}
+
+    // Adds a file, or all the files in a directory (in name order).
+    // Reports what went wrong on stderr before returning false:
+    bool add(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1) {
+            perror(path.c_str());
+            return false;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            return add_job(path, path.substr(path.find_last_of('/') + 1));
+        }
+
+        DIR* dir = opendir(path.c_str());
+        if (!dir) {
+            perror(path.c_str());
+            return false;
+        }
+
+        std::vector<std::string> names;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = path + "/" + entry->d_name;
+            if (entry->d_name[0] != '.' &&
+                stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+
+        std::sort(names.begin(), names.end());
+        for (auto &name: names) {
+            if (!add_job(path + "/" + name, name)) return false;
+        }
+        return true;
+    }
+
+    size_t size() const {return jobs_.size();}
+
+    // Returns the number of inputs that failed. Each thread has a tape
+    // while it runs an input, so there are never more of them than
+    // tapes can be live at once:
+    size_t run(JITProgram::Code code, size_t threads) {
+        code_ = code;
+        threads = std::min(threads, Tape::MaxTapes);
+        threads = std::max<size_t>(1, std::min(threads, jobs_.size()));
+
+        queues_.clear();
+        for (size_t i = 0; i < threads; ++i) {
+            queues_.emplace_back(new Queue());
+        }
+        for (size_t i = 0; i < jobs_.size(); ++i) {
+            queues_[i * threads / jobs_.size()]->jobs.push_back(i);
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i] {work(i);});
+        }
+
+        size_t failed = 0;
+        for (size_t i = 0; i < jobs_.size(); ++i) {
+            Job& job = jobs_[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_.wait(lock, [&job] {return job.done;});
+            }
+            if (output_dir_.empty() && job.out_fd != -1) {
+                copy(job.out_fd, STDOUT_FILENO);
+            }
+            if (job.out_fd != -1) {
+                close(job.out_fd);
+            }
+            if (!job.ok) {
+                std::cerr << "Error: " << job.input << " failed" << std::endl;
+                ++failed;
+            }
+        }
+
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        return failed;
+    }
+
+private:
+    bool add_job(const std::string& input, const std::string& name) {
+        if (!output_dir_.empty()) {
+            for (auto &job: jobs_) {
+                if (job.name != name) continue;
+                std::cerr << "Error: " << job.input << " and " << input
+                          << " would both write to " << name << ".out" << std::endl;
+                return false;
+            }
+        }
+        jobs_.emplace_back();
+        jobs_.back().input = input;
+        jobs_.back().name = name;
+        return true;
+    }
+
+    void work(size_t id) {
+        size_t index;
+        while (next(id, index)) {
+            Job& job = jobs_[index];
+            bool ok = execute(job);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            job.ok = ok;
+            job.done = true;
+            done_.notify_all();
+        }
+    }
+
+    // The front of this worker's queue, or else the back of the
+    // longest one:
+    bool next(size_t id, size_t& index) {
+        if (pop(*queues_[id], false, index)) return true;
+
+        while (true) {
+            Queue* victim = nullptr;
+            size_t longest = 0;
+            for (auto &queue: queues_) {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                if (queue->jobs.size() > longest) {
+                    longest = queue->jobs.size();
+                    victim = queue.get();
+                }
+            }
+            if (!victim) return false;
+            // (someone else may have emptied it in the meantime)
+            if (pop(*victim, true, index)) return true;
+        }
+    }
+
+    static bool pop(Queue& queue, bool back, size_t& index) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) return false;
+        if (back) {
+            index = queue.jobs.back();
+            queue.jobs.pop_back();
+        } else {
+            index = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        return true;
+    }
+
+    bool execute(Job& job) {
+        int in_fd = open(job.input.c_str(), O_RDONLY);
+        if (in_fd == -1) {
+            perror(job.input.c_str());
+            return false;
+        }
+
+        job.out_fd = output_dir_.empty() ? temporary() : output(job.name);
+        if (job.out_fd == -1) {
+            close(in_fd);
+            return false;
+        }
+
+        bool ok = JITProgram::execute(code_, cell_, policy_, in_fd, job.out_fd);
+        close(in_fd);
+        return ok;
+    }
+
+    int output(const std::string& name) const {
+        std::string path = output_dir_ + "/" + name + ".out";
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) perror(path.c_str());
+        return fd;
+    }
+
+    static int temporary() {
+        const char* dir = getenv("TMPDIR");
+        std::string path = std::string(dir && *dir ? dir : "/tmp") +
+                           "/brainfuck-batch.XXXXXX";
+
+        int fd = mkstemp(&path[0]);
+        if (fd == -1) {
+            perror(path.c_str());
+            return -1;
+        }
+        unlink(path.c_str());
+        return fd;
+    }
+
+    static void copy(int from, int to) {
+        char buffer[1 << 16];
+        ssize_t count;
+        lseek(from, 0, SEEK_SET);
+        while ((count = read(from, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t written = 0, n; written < count; written += n) {
+                n = write(to, buffer + written, count - written);
+                if (n < 0) return;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "adt.h"
+#include "brainfuck.h"
+#include "cache.h"
+#include "jit.h"
+#include "passes.h"
+#include "source.h"
+#include "threaded.h"
+#include "tiered.h"
+
+// Benchmarks the engines in-process, over the programs in ../programs
+// (or the ones given), timing each phase on its own: parsing, the
+// optimization passes (the partial evaluation included), compiling
+// (for the engines that do) and running. Each program is run a few
+// times after some warmup runs, and the median and 95th percentile of
+// each phase are reported, as a table or as JSON (--json=FILE), which
+// can be given back as --baseline=FILE to flag the phases that got
+// slower since then.
+//
+// The outputs of all the engines are compared with the first one's,
+// so a mismatch shows up too.
+//
+//   $ ./brainfuck-bench --json=before.json
+//   ... (change something)
+//   $ ./brainfuck-bench --baseline=before.json
+
+using Clock = std::chrono::steady_clock;
+
+enum Phase {Parse, Optimize, Compile, Execute, Phases};
+
+static const char* phase_names[Phases] = {"parse", "optimize", "compile", "execute"};
+
+// The time of each phase of one run (negative for the phases an engine
+// doesn't have):
+class Timings
+{
+private:
+    double ms_[Phases];
+    Clock::time_point start_;
+
+public:
+    Timings() : start_(Clock::now()) {std::fill(ms_, ms_ + Phases, -1.0);}
+
+    // Ends the given phase, and starts the next one:
+    void lap(Phase phase) {
+        auto now = Clock::now();
+        ms_[phase] = std::chrono::duration<double, std::milli>(now - start_).count();
+        start_ = Clock::now();
+    }
+
+    double operator[](int phase) const {return ms_[phase];}
+};
+
+// What a program needs to run: its input, and what ',' does at the end
+// of it:
+struct Workload
+{
+    std::string input;
+    IOPolicy io;
+    bool skip = false;  // (runs forever)
+};
+
+class Engine
+{
+public:
+    virtual ~Engine() {}
+    virtual const char* name() const = 0;
+    virtual void run(std::string_view source, const Workload& workload, size_t cell,
+                     int in_fd, int out_fd, Timings& timings) = 0;
+};
+
+template <typename F>
+static void with_cell(size_t cell, F&& f) {
+    switch (cell) {
+        case 1: f(uint8_t()); break;
+        case 2: f(uint16_t()); break;
+        default: f(uint32_t()); break;
+    }
+}
+
+// The passes all the OOP-based engines run (all of them, unless told
+// otherwise with -O0..-O3 and --enable-pass/--disable-pass):
+static PassOptions passes;
+
+class ADTEngine : public Engine
+{
+public:
+    // (always with 32-bit cells)
+    const char* name() const {return "adt";}
+
+    void run(std::string_view source, const Workload& workload, size_t,
+             int in_fd, int out_fd, Timings& timings) {
+        PassManager manager(passes, 4);
+        auto parsed = manager.parse(source);
+        timings.lap(Parse);
+        auto optimized = manager.optimize(std::move(parsed));
+        const Prefix& prefix = manager.prefix();
+        timings.lap(Optimize);
+        auto lowered = adt::lower(optimized);
+        timings.lap(Compile);
+        adt::run(lowered.expressions(), prefix, workload.io, in_fd, out_fd);
+        timings.lap(Execute);
+    }
+};
+
+class OOPEngine : public Engine
+{
+public:
+    const char* name() const {return "oop";}
+
+    void run(std::string_view source, const Workload& workload, size_t cell,
+             int in_fd, int out_fd, Timings& timings) {
+        PassManager manager(passes, cell);
+        auto parsed = manager.parse(source);
+        timings.lap(Parse);
+        auto optimized = manager.optimize(std::move(parsed));
+        const Prefix& prefix = manager.prefix();
+        timings.lap(Optimize);
+        with_cell(cell, [&](auto zero) {
+            using T = decltype(zero);
+            std::unique_ptr<Runner<T>> runner(new Runner<T>(workload.io, in_fd, out_fd));
+            runner->restore(prefix);
+            runner->run(optimized.expressions());
+        });
+        timings.lap(Execute);
+    }
+};
+
+class ThreadedEngine : public Engine
+{
+public:
+    const char* name() const {return "threaded";}
+
+    void run(std::string_view source, const Workload& workload, size_t cell,
+             int in_fd, int out_fd, Timings& timings) {
+        PassManager manager(passes, cell);
+        auto parsed = manager.parse(source);
+        timings.lap(Parse);
+        auto optimized = manager.optimize(std::move(parsed));
+        const Prefix& prefix = manager.prefix();
+        timings.lap(Optimize);
+        auto code = BytecodeCompiler().compile(optimized.expressions());
+        timings.lap(Compile);
+        with_cell(cell, [&](auto zero) {
+            ThreadedRunner(workload.io, in_fd, out_fd).run<decltype(zero)>(code, prefix);
+        });
+        timings.lap(Execute);
+    }
+};
+
+class JITEngine : public Engine
+{
+public:
+    const char* name() const {return "jit";}
+
+    void run(std::string_view source, const Workload& workload, size_t cell,
+             int in_fd, int out_fd, Timings& timings) {
+        PassManager manager(passes, cell);
+        auto parsed = manager.parse(source);
+        timings.lap(Parse);
+        auto optimized = manager.optimize(std::move(parsed));
+        const Prefix& prefix = manager.prefix();
+        timings.lap(Optimize);
+        ExecutableBuffer buffer(JITCompiler::code_size(optimized.expressions(), prefix));
+        JITProgram program(buffer, NativeABI, cell, workload.io);
+        JITCompiler(program, has_avx2()).compile(optimized.expressions(), prefix);
+        JITProgram::Code code = program.code();
+        timings.lap(Compile);
+        JITProgram::execute(code, cell, workload.io, in_fd, out_fd);
+        timings.lap(Execute);
+    }
+};
+
+class TieredEngine : public Engine
+{
+public:
+    // (compiling is part of running)
+    const char* name() const {return "tiered";}
+
+    void run(std::string_view source, const Workload& workload, size_t cell,
+             int in_fd, int out_fd, Timings& timings) {
+        PassManager manager(passes, cell);
+        auto parsed = manager.parse(source);
+        timings.lap(Parse);
+        auto optimized = manager.optimize(std::move(parsed));
+        const Prefix& prefix = manager.prefix();
+        timings.lap(Optimize);
+        with_cell(cell, [&](auto zero) {
+            std::unique_ptr<TieredRunner<decltype(zero)>> runner(
+                new TieredRunner<decltype(zero)>(workload.io, 1000, has_avx2(),
+                                                 JITTuning(), in_fd, out_fd)
+            );
+            runner->run(optimized.expressions(), prefix);
+        });
+        timings.lap(Execute);
+    }
+};
+
+static std::string read_file(const std::string& path) {
+    SourceFile file(path.c_str());
+    return file ? std::string(file.view()) : std::string();
+}
+
+// The inputs the programs in ../programs expect:
+static Workload workload(const std::string& dir, const std::string& name) {
+    Workload workload;
+
+    std::string text;
+    for (int i = 0; i < 200; ++i) {
+        text += "The Quick Brown Fox Jumps Over The Lazy Dog, " + std::to_string(i) + "\n";
+    }
+
+    if (name == "primes.bf") {
+        workload.input = "200\n";
+    } else if (name == "atoi.bf") {
+        workload.input = "4242\n";
+    } else if (name == "numwarp.bf") {
+        workload.input = "1234567890\n";
+    } else if (name == "cat.bf" || name == "cat2.bf" ||
+               name == "rot13.bf" || name == "tolower.bf") {
+        workload.input = text;
+    } else if (name == "wc.bf") {
+        workload.input = text;
+        workload.io.eof = EOFPolicy::Zero;
+    } else if (name == "dbf2c.bf") {
+        workload.input = read_file(dir + "/mandelbrot.bf");
+    } else if (name == "dbfi.bf") {
+        workload.input = read_file(dir + "/hello.bf") + "!";
+    } else if (name == "fibonacci.bf" || name == "random.bf") {
+        workload.skip = true;
+    }
+
+    return workload;
+}
+
+static std::vector<std::string> list_programs(const std::string& dir) {
+    std::vector<std::string> programs;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (struct dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, ".bf") == 0) {
+                programs.push_back(dir + "/" + name);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(programs.begin(), programs.end());
+    return programs;
+}
+
+static int temporary() {
+    const char* dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/brainfuck-bench.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd != -1) unlink(path.c_str());
+    return fd;
+}
+
+static uint64_t hash_file(int fd) {
+    std::string contents;
+    char buffer[1 << 16];
+    ssize_t count;
+    lseek(fd, 0, SEEK_SET);
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, count);
+    }
+    return fnv1a(contents.data(), contents.size());
+}
+
+struct Result
+{
+    std::string engine, program, phase;
+    double median, p95;
+    size_t runs;
+    bool output_ok;
+};
+
+static double percentile(std::vector<double> samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    size_t rank = size_t(std::ceil(p * samples.size()));
+    return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// Reads back a file written by write_json() (one result per line):
+static std::map<std::string, double> read_baseline(const std::string& path) {
+    auto field = [](const std::string& line, const std::string& key) {
+        size_t pos = line.find("\"" + key + "\": ");
+        if (pos == std::string::npos) return std::string();
+        pos += key.size() + 4;
+        if (line[pos] == '"') {
+            return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+        }
+        return line.substr(pos, line.find_first_of(",}", pos) - pos);
+    };
+
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        double median;
+        if (!parse_number(field(line, "median_ms"), median)) continue;
+        baseline[field(line, "engine") + " " + field(line, "program") + " " +
+                 field(line, "phase")] = median;
+    }
+    return baseline;
+}
+
+static void write_json(std::ostream& os, const std::vector<Result>& results) {
+    os << "{\"results\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << "  {\"engine\": \"" << r.engine << "\", \"program\": \"" << r.program
+           << "\", \"phase\": \"" << r.phase << "\", \"median_ms\": " << r.median
+           << ", \"p95_ms\": " << r.p95 << ", \"runs\": " << r.runs
+           << ", \"output_ok\": " << (r.output_ok ? "true" : "false") << "}"
+           << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    os << "]}" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::string dir = "../programs";
+    std::vector<std::string> programs;
+    std::vector<std::string> engine_names;
+    std::string json, baseline_path;
+    size_t cell = 4;
+    size_t warmup = 1, repetitions = 5;
+    double threshold = 10;      // (%)
+    double min_change = 0.1;    // (ms, smaller changes are noise)
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option(argv[arg]);
+        if (option.compare(0, 10, "--engines=") == 0) {
+            std::stringstream list(option.substr(10));
+            std::string name;
+            while (std::getline(list, name, ',')) engine_names.push_back(name);
+        } else if (option.compare(0, 9, "--warmup=") == 0 &&
+                   parse_number(option.substr(9), warmup)) {
+            continue;
+        } else if (option.compare(0, 14, "--repetitions=") == 0 &&
+                   parse_number(option.substr(14), repetitions)) {
+            repetitions = std::max<size_t>(1, repetitions);
+        } else if (option.compare(0, 7, "--json=") == 0) {
+            json = option.substr(7);
+        } else if (option.compare(0, 11, "--baseline=") == 0) {
+            baseline_path = option.substr(11);
+        } else if (option.compare(0, 12, "--threshold=") == 0 &&
+                   parse_number(option.substr(12), threshold)) {
+            continue;
+        } else if (option.compare(0, 15, "--programs-dir=") == 0) {
+            dir = option.substr(15);
+        } else if (option == "--cell=8") {
+            cell = 1;
+        } else if (option == "--cell=16") {
+            cell = 2;
+        } else if (option == "--cell=32") {
+            cell = 4;
+        } else if (passes.parse(option)) {
+            continue;
+        } else if (option.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        } else {
+            programs.push_back(option);
+        }
+    }
+
+    std::vector<std::unique_ptr<Engine>> all;
+    all.emplace_back(new ADTEngine());
+    all.emplace_back(new OOPEngine());
+    all.emplace_back(new ThreadedEngine());
+    all.emplace_back(new JITEngine());
+    all.emplace_back(new TieredEngine());
+
+    std::vector<Engine*> engines;
+    for (auto &engine: all) {
+        // (the ADT version only has 32-bit cells)
+        if (cell != 4 && std::string(engine->name()) == "adt") continue;
+        if (engine_names.empty() ||
+            std::find(engine_names.begin(), engine_names.end(), engine->name()) != engine_names.end()) {
+            engines.push_back(engine.get());
+        }
+    }
+
+    if (programs.empty()) {
+        programs = list_programs(dir);
+    }
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty()) {
+        baseline = read_baseline(baseline_path);
+        if (baseline.empty()) {
+            std::cerr << "Invalid baseline: " << baseline_path << std::endl;
+            return 1;
+        }
+    }
+
+    int in_fd = temporary(), out_fd = temporary();
+    if (in_fd == -1 || out_fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    std::vector<Result> results;
+    size_t regressions = 0, mismatches = 0;
+
+    std::cout << std::left << std::setw(10) << "engine" << std::setw(16) << "program"
+              << std::setw(10) << "phase" << std::right << std::setw(12) << "median ms"
+              << std::setw(12) << "p95 ms" << (baseline.empty() ? "" : "    change") << std::endl;
+
+    for (auto &path: programs) {
+        SourceFile source(path.c_str());
+        if (!source) {
+            std::cerr << "Invalid filename: " << path << std::endl;
+            return 1;
+        }
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        Workload work = workload(dir, name);
+        if (work.skip) continue;
+
+        if (ftruncate(in_fd, 0) == -1 ||
+            pwrite(in_fd, work.input.data(), work.input.size(), 0) != ssize_t(work.input.size())) {
+            perror("input");
+            return 1;
+        }
+
+        bool have_expected = false;
+        uint64_t expected = 0;
+
+        for (auto engine: engines) {
+            std::vector<double> samples[Phases];
+            bool output_ok = true;
+
+            for (size_t i = 0; i < warmup + repetitions; ++i) {
+                lseek(in_fd, 0, SEEK_SET);
+                lseek(out_fd, 0, SEEK_SET);
+                if (ftruncate(out_fd, 0) == -1) {}
+
+                Timings timings;
+                try {
+                    engine->run(source.view(), work, cell, in_fd, out_fd, timings);
+                } catch (std::exception& e) {
+                    std::cerr << "Error: " << engine->name() << " " << name << ": "
+                              << e.what() << std::endl;
+                    return 1;
+                }
+
+                uint64_t output = hash_file(out_fd);
+                if (!have_expected) {
+                    expected = output;
+                    have_expected = true;
+                }
+                output_ok = output_ok && output == expected;
+
+                if (i < warmup) continue;
+                for (int phase = 0; phase < Phases; ++phase) {
+                    if (timings[phase] >= 0) samples[phase].push_back(timings[phase]);
+                }
+            }
+
+            if (!output_ok) ++mismatches;
+
+            for (int phase = 0; phase < Phases; ++phase) {
+                if (samples[phase].empty()) continue;
+
+                Result result = {engine->name(), name, phase_names[phase],
+                                 percentile(samples[phase], 0.5),
+                                 percentile(samples[phase], 0.95),
+                                 samples[phase].size(), output_ok};
+                results.push_back(result);
+
+                std::cout << std::left << std::setw(10) << result.engine
+                          << std::setw(16) << result.program << std::setw(10) << result.phase
+                          << std::right << std::fixed << std::setprecision(3)
+                          << std::setw(12) << result.median << std::setw(12) << result.p95;
+
+                auto it = baseline.find(result.engine + " " + result.program + " " + result.phase);
+                if (it != baseline.end() && it->second > 0) {
+                    double change = (result.median - it->second) / it->second * 100;
+                    std::cout << std::showpos << std::setprecision(1) << std::setw(9)
+                              << change << "%" << std::noshowpos;
+                    if (change > threshold && result.median - it->second > min_change) {
+                        std::cout << "  REGRESSION";
+                        ++regressions;
+                    }
+                }
+                if (!output_ok) std::cout << "  MISMATCH";
+                std::cout << std::endl;
+            }
+        }
+    }
+
+    if (!json.empty()) {
+        std::ofstream file(json);
+        write_json(file, results);
+        if (!file) {
+            perror(json.c_str());
+            return 1;
+        }
+    }
+
+    if (!baseline.empty()) {
+        std::cout << regressions << " regression(s) over " << threshold << "%" << std::endl;
+    }
+    if (mismatches) {
+        std::cout << mismatches << " output mismatch(es)" << std::endl;
+    }
+
+    return regressions || mismatches ? 1 : 0;
+}
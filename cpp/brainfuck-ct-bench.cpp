@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "brainfuck.h"
+#include "compiletime.h"
+#include "jit.h"
+#include "passes.h"
+
+// Compares mandelbrot.bf compiled along with this file (see
+// compiletime.h, the Makefile wraps the source in a string literal)
+// with the same program through the JIT, parsed and compiled when it
+// runs, as brainfuck-jit does. Both write to a temporary file, and the
+// outputs have to be the same:
+//
+//   $ ./brainfuck-ct-bench --repetitions=5
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr char mandelbrot[] =
+#include "mandelbrot.bf.inc"
+;
+
+static constexpr auto program = ct::compile(mandelbrot);
+
+static int temporary() {
+    const char* dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/brainfuck-ct-bench.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd != -1) unlink(path.c_str());
+    return fd;
+}
+
+static std::string contents(int fd) {
+    std::string contents;
+    char buffer[1 << 16];
+    ssize_t count;
+    lseek(fd, 0, SEEK_SET);
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, count);
+    }
+    lseek(fd, 0, SEEK_SET);
+    if (ftruncate(fd, 0) == -1) {}
+    return contents;
+}
+
+// Times 'f' (after a warmup run), and checks its output:
+template <typename F>
+static bool measure(const char* name, size_t repetitions, int out_fd,
+                    std::string& expected, F&& f) {
+    std::vector<double> samples;
+    bool same = true;
+
+    for (size_t i = 0; i <= repetitions; ++i) {
+        auto start = Clock::now();
+        f();
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        std::string output = contents(out_fd);
+        if (expected.empty()) expected = output;
+        same = same && output == expected;
+        if (i) samples.push_back(ms);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+              << std::setprecision(1) << std::setw(12) << samples[samples.size() / 2]
+              << std::setw(12) << samples.front()
+              << (same ? "" : "    (different output)") << std::endl;
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    size_t repetitions = 5;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option(argv[arg]);
+        if (option.compare(0, 14, "--repetitions=") == 0 &&
+            parse_number(option.substr(14), repetitions)) {
+            repetitions = std::max<size_t>(1, repetitions);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    int out_fd = temporary();
+    if (out_fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    IOPolicy io;
+    std::string expected;
+
+    std::cout << "mandelbrot.bf: " << program.size << " ops" << std::endl
+              << std::left << std::setw(10) << "engine" << std::right
+              << std::setw(12) << "median ms" << std::setw(12) << "best ms" << std::endl;
+
+    bool ok = measure("ct", repetitions, out_fd, expected, [&] {
+        ct::run<program>(io, STDIN_FILENO, out_fd);
+    });
+
+    ok = measure("jit", repetitions, out_fd, expected, [&] {
+        PassManager manager(PassOptions(), 4);
+        auto parsed = manager.run(std::string_view(mandelbrot));
+        ExecutableBuffer buffer(JITCompiler::code_size(parsed.expressions(), manager.prefix()));
+        JITProgram jit_program(buffer, NativeABI, 4, io);
+        JITCompiler(jit_program).compile(parsed.expressions(), manager.prefix());
+        JITProgram::execute(jit_program.code(), 4, io, STDIN_FILENO, out_fd);
+    }) && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "brainfuck.h"
+#include "cc.h"
+#include "io.h"
+#include "jit.h"
+
+// Checks that reads and writes interrupted by a signal are retried,
+// instead of being taken for the end of the input (or a failed write),
+// in each of the I/O layers: IOContext (the interpreters), the JIT's
+// subroutines and the code of the C backend.
+//
+// Each case echoes its input (",[.,]") while a timer sends SIGALRM to
+// the process every few milliseconds, through a handler installed
+// without SA_RESTART, and the input only arrives after a while, so the
+// program is blocked in read() when the signals come. Run by 'make test'.
+
+static const char* Echo = ",[.,]";
+static const std::string Input = "interrupted\n";
+
+static void on_alarm(int) {}
+
+// Runs 'f' with its input coming late from a pipe and its output going
+// to another one, and returns what it wrote:
+static std::string echo(const std::function<void (int, int)>& f) {
+    int in[2], out[2];
+    if (pipe(in) == -1 || pipe(out) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+
+    // The threads are started with SIGALRM blocked, so it interrupts 'f':
+    sigset_t alarm, previous;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &previous);
+
+    std::thread writer([&in] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        if (write(in[1], Input.data(), Input.size()) < 0) {}
+        close(in[1]);
+    });
+    std::string output;
+    std::thread reader([&out, &output] {
+        char buffer[256];
+        ssize_t count;
+        while ((count = read(out[0], buffer, sizeof(buffer))) > 0) {
+            output.append(buffer, count);
+        }
+        close(out[0]);
+    });
+
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = 10000;
+    timer.it_value.tv_usec = 10000;
+    setitimer(ITIMER_REAL, &timer, nullptr);
+
+    f(in[0], out[1]);
+
+    timer = {};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+    close(in[0]);
+    close(out[1]);
+
+    writer.join();
+    reader.join();
+    return output;
+}
+
+static bool check(const char* name, const std::string& output) {
+    bool ok = output == Input;
+    std::cout << (ok ? "ok     " : "FAILED ") << name << std::endl;
+    return ok;
+}
+
+int main() {
+    struct sigaction action = {};
+    action.sa_handler = on_alarm;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, nullptr);
+    // (a failing case may stop reading before its input arrives)
+    signal(SIGPIPE, SIG_IGN);
+
+    Program program = Parser().parse(Echo);
+    IOPolicy policy;
+    bool ok = true;
+
+    ok &= check("io.h", echo([&](int in_fd, int out_fd) {
+        IOContext io(policy, in_fd, out_fd);
+        int c;
+        try {
+            while (io.read(c)) io.write(uint8_t(c));
+        } catch (EndOfInput&) {}
+    }));
+
+    ExecutableBuffer buffer(JITCompiler::code_size(program.expressions()));
+    JITProgram jit_program(buffer, NativeABI, 1, policy);
+    JITCompiler(jit_program).compile(program.expressions());
+
+    ok &= check("jit.h", echo([&](int in_fd, int out_fd) {
+        JITProgram::execute(jit_program.code(), 1, policy, in_fd, out_fd);
+    }));
+
+    try {
+        std::string source = CEmitter(1, policy).emit(program.expressions(), Prefix());
+        auto code = NativeBackend("").compile(source);
+
+        ok &= check("cc.h", echo([&](int in_fd, int out_fd) {
+            JITProgram::execute(code->code(), 1, policy, in_fd, out_fd);
+        }));
+    } catch (std::exception& e) {
+        std::cout << "skipped cc.h (" << e.what() << ")" << std::endl;
+    }
+
+    return ok ? 0 : 1;
+}
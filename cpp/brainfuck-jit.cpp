@@ -1,285 +1,217 @@
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
-#include <sys/mman.h>
-#include <cstring>
-
+#include "batch.h"
 #include "brainfuck.h"
+#include "cache.h"
+#include "cc.h"
+#include "debuginfo.h"
+#include "jit.h"
+#include "passes.h"
+#include "source.h"
 
-// Wraps an mmap()ed area, which starts with read/write permissions,
-// but that can be later turned into read/exec before execution.
-// This is good practice since the pages are never writable AND executable
-// _at the same_time_
-// (See https://eli.thegreenplace.net/2013/11/05/how-to-jit-an-introduction)
-class ExecutableBuffer
-{
-private:
-    uint8_t *buf_,
-            *ptr_;
-    size_t size_;
-
-public:
-    ExecutableBuffer(size_t size) {
-        size_ = size;
-        buf_ = (uint8_t*) mmap(
-            0,
-            size_,
-            PROT_READ | PROT_WRITE,
-            MAP_PRIVATE | MAP_ANONYMOUS,
-            -1,
-            0
-        );
-        if (buf_ == MAP_FAILED) {
-            perror("mmap");
-            exit(1);
+int main(int argc, char *argv[]) {
+    OSABI abi = NativeABI;
+    bool native = false;
+    bool avx2 = has_avx2();
+    size_t cell = 4;
+    IOPolicy io;
+    PassOptions passes;
+    JITTuning tuning;
+    const char* elf = nullptr;
+    std::string cache_dir = CodeCache::default_dir();
+    size_t cache_size = CodeCache::DefaultMaxSize;
+    std::vector<std::string> batch;
+    std::string output_dir;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    ProfileOptions profiling;
+    DebugOptions debug;
+    int arg = 1;
+
+    for (; arg < argc - 1; ++arg) {
+        std::string option(argv[arg]);
+        if (option == "--backend=jit") {
+            native = false;
+        } else if (option == "--backend=cc") {
+            native = true;
+        } else if (option == "--emit-elf" && arg + 1 < argc - 1) {
+            elf = argv[++arg];
+        } else if (option.compare(0, 8, "--batch=") == 0) {
+            batch.push_back(option.substr(8));
+        } else if (option.compare(0, 13, "--output-dir=") == 0) {
+            output_dir = option.substr(13);
+        } else if (option.compare(0, 10, "--threads=") == 0 &&
+                   parse_number(option.substr(10), threads)) {
+            threads = std::max<size_t>(1, threads);
+        } else if (option == "--no-cache") {
+            cache_dir.clear();
+        } else if (option.compare(0, 12, "--cache-dir=") == 0) {
+            cache_dir = option.substr(12);
+        } else if (option.compare(0, 13, "--cache-size=") == 0 &&
+                   parse_number(option.substr(13), cache_size, SIZE_MAX >> 20)) {
+            cache_size <<= 20; // (in MB)
+        } else if (option == "--abi=linux") {
+            abi = OSABI::Linux;
+        } else if (option == "--abi=darwin") {
+            abi = OSABI::Darwin;
+        } else if (option == "--no-avx2") {
+            avx2 = false;
+        } else if (option == "--cell=8") {
+            cell = 1;
+        } else if (option == "--cell=16") {
+            cell = 2;
+        } else if (option == "--cell=32") {
+            cell = 4;
+        } else if (io.parse(option) || passes.parse(option) || tuning.parse(option) ||
+                   profiling.parse(option) || debug.parse(option)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
         }
-        ptr_ = buf_;
-        memset(ptr_, 0x00, size);
     }
 
-    ~ExecutableBuffer() {
-        if(munmap(buf_, size_) == -1) {
-            perror("munmap");
-            exit(1);
-        }
+    // The executables are for Linux, whatever the host is:
+    if (elf) {
+        abi = OSABI::Linux;
     }
 
-    void make_executable() {
-        if (mprotect(buf_, size_, PROT_READ | PROT_EXEC) == -1) {
-            perror("mprotect");
-            exit(1);
+    // The code of a profile has the addresses of its counters:
+    if (profiling.enabled) {
+        if (elf || !batch.empty()) {
+            std::cerr << "--profile can't be used with --emit-elf or --batch" << std::endl;
+            return 1;
         }
+        cache_dir.clear();
     }
 
-    uint8_t* get_base () const { return buf_; }
-    uint8_t* get_ptr () const { return ptr_; }
-    void set_ptr (uint8_t* ptr) { ptr_ = ptr; }
-
-    void writeb(uint8_t byte) {
-        // write a single byte
-        (*ptr_++) = byte;
-    }
-
-    void writel(uint32_t value) {
-        // write a 4-bytes word, keeping endianness
-        writes((uint8_t*)&value, 4);
-    }
-
-    void writes(const uint8_t* bytes, uint32_t size) {
-        // write an arbitrary-length series of bytes
-        memcpy(ptr_, bytes, size);
-        ptr_ += size;
-    }
-};
-
-class JITProgram
-{
-private:
-    ExecutableBuffer &buf_;
-
-public:
-    JITProgram(ExecutableBuffer &buf)
-      : buf_(buf) {}
-
-    ExecutableBuffer& buffer() {return buf_;}
-
-    void start() {
-        // 0000000000000070 break:
-        //       70: cc                            int3
-        // buf_.writeb(0xcc);
-    }
-
-    void finish() {
-        // 0000000000000071 finish:
-        //       71: c3                            retq
-        buf_.writeb(0xc3);
-    }
-
-    void run() {
-        uint32_t memory[30000];
-        memset(memory, 0x00, sizeof(memory));
-
-        // Set the buffer as executable before attempting to jump
-        // into it:
-        buf_.make_executable();
-
-        // Capture the buffer base ptr:
-        uint8_t* _base = buf_.get_base();
-
-        // Inject the address of the working memory in the rdi reg:
-        asm("movq %0, %%rdi\n":
-            : "r"(&memory)
-            : "%rdi");
-
-        // Cast the base as a func pointer and jump to it:
-        ((void (*)()) _base)();
+    // And the cache doesn't keep where the code comes from:
+    if (debug.enabled()) {
+        if (elf) {
+            std::cerr << "--perf-map, --jitdump and --gdb-jit can't be used with --emit-elf" << std::endl;
+            return 1;
+        }
+        cache_dir.clear();
     }
-};
-
-class JITCompiler : public ExpressionVisitor
-{
-private:
-    JITProgram &program_;
-    ExecutableBuffer &buffer_;
 
-public:
-    JITCompiler(JITProgram &program)
-      : program_(program),
-        buffer_(program_.buffer()) {}
-
-    virtual void visit(const Increment& inc) {
-        // 0000000000000000 increment:
-        //        0: 48 c7 c0 01 00 00 00          movq    $1, %rax
-        //        7: 01 07                         addl    %eax, (%rdi)
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(inc.offset());
-        buffer_.writes((uint8_t*)"\x01\x07", 2);        
+    // The C backend only makes code to run:
+    if (native && (elf || profiling.enabled || debug.enabled())) {
+        std::cerr << "--backend=cc can't be used with --emit-elf, --profile, "
+                     "--perf-map, --jitdump or --gdb-jit" << std::endl;
+        return 1;
     }
 
-    virtual void visit(const Decrement& dec) {
-        // 0000000000000009 decrement:
-        //        9: 48 c7 c0 01 00 00 00          movq    $1, %rax
-        //       10: 29 07                         subl    %eax, (%rdi)
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(dec.offset());
-        buffer_.writes((uint8_t*)"\x29\x07", 2);
+    // The same code runs over each of the inputs:
+    BatchRunner runner(cell, io, output_dir);
+    for (auto &path: batch) {
+        if (!runner.add(path)) return 1;
     }
+    auto run = [&](JITProgram::Code code) {
+        if (batch.empty()) {
+            return JITProgram::execute(code, cell, io) ? 0 : 1;
+        }
+        size_t failed = runner.run(code, threads);
+        if (failed) {
+            std::cerr << failed << " of " << runner.size() << " inputs failed" << std::endl;
+        }
+        return failed != 0 ? 1 : 0;
+    };
 
-    virtual void visit(const Forward& fwd) {
-        // 0000000000000012 forward:
-        //       12: 48 c7 c0 01 00 00 00          movq    $1, %rax
-        //       19: 48 01 c7                      addq    %rax, %rdi
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(fwd.offset()*4);
-        buffer_.writes((uint8_t*)"\x48\x01\xc7", 3);
-    }
+    SourceFile program(argv[arg]);
 
-    virtual void visit(const Backward& bwd) {
-        // 000000000000001c backward:
-        //       1c: 48 c7 c0 01 00 00 00          movq    $1, %rax
-        //       23: 48 29 c7                      subq    %rax, %rdi
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(bwd.offset()*4);
-        buffer_.writes((uint8_t*)"\x48\x29\xc7", 3);
+    if (!program) {
+        std::cerr << "Invalid filename!" << std::endl;
+        return 1;
     }
 
-    virtual void visit(const Input&) {
-        // 0000000000000026 read:
-        //       26: 57                            pushq   %rdi
-        //       27: 48 c7 c0 03 00 00 02          movq    $33554435, %rax
-        //       2e: 48 89 fe                      movq    %rdi, %rsi
-        //       31: 48 c7 c7 00 00 00 00          movq    $0, %rdi
-        //       38: 48 c7 c2 01 00 00 00          movq    $1, %rdx
-        //       3f: 0f 05                         syscall
-        //       41: 5f                            popq    %rdi        
+    // Everything the generated code depends on (besides the source),
+    // including the version of the code generator:
+    std::string options = "version=" + std::to_string(CodeCache::Version) +
+        " abi=" + std::to_string(int(abi)) +
+        " cell=" + std::to_string(cell) +
+        " avx2=" + std::to_string(avx2) +
+        " flush=" + std::to_string(int(io.flush)) +
+        " eof=" + std::to_string(int(io.eof)) +
+        " " + passes.key() +
+        " " + tuning.key();
 
-        buffer_.writeb(0x57);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(0x02000003);
-        buffer_.writes((uint8_t*)"\x48\x89\xfe", 3);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc7\x00\x00\x00\x00", 7);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc2\x01\x00\x00\x00", 7);
-        buffer_.writes((uint8_t*)"\x0f\x05", 2);
-        buffer_.writeb(0x5f);
-    }
-
-    virtual void visit(const Output&) {
-        // 0000000000000042 write:
-        //       42: 57                            pushq   %rdi
-        //       43: 48 c7 c0 04 00 00 02          movq    $33554436, %rax
-        //       4a: 48 89 fe                      movq    %rdi, %rsi
-        //       4d: 48 c7 c7 01 00 00 00          movq    $1, %rdi
-        //       54: 48 c7 c2 01 00 00 00          movq    $1, %rdx
-        //       5b: 0f 05                         syscall
-        //       5d: 5f                            popq    %rdi
+    // The executables are written from a fresh compilation instead
+    // (and the C backend has its own entries):
+    CodeCache cache(elf || native ? "" : cache_dir, cache_size);
 
-        buffer_.writeb(0x57);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc0", 3);
-        buffer_.writel(0x02000004);
-        buffer_.writes((uint8_t*)"\x48\x89\xfe", 3);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc7\x01\x00\x00\x00", 7);
-        buffer_.writes((uint8_t*)"\x48\xc7\xc2\x01\x00\x00\x00", 7);
-        buffer_.writes((uint8_t*)"\x0f\x05", 2);
-        buffer_.writeb(0x5f);
+    if (CachedCode cached = cache.lookup(program.view(), options)) {
+        return run((JITProgram::Code) cached.code());
     }
 
-    virtual void visit(const Loop& loop) {
-        // 000000000000005e loop_start:
-        //       5e: 83 3f 00                      cmpl    $0, (%rdi)
-        //       61: 0f 84 00 00 00 00             je  0
-        buffer_.writes((uint8_t*)"\x83\x3f\x00", 3);
-        buffer_.writes((uint8_t*)"\x0f\x84", 2);
-        buffer_.writel(0); // reserve 4 bytes
-
-        // Save current position:
-        uint8_t *after_loop_start = buffer_.get_ptr();
-
-        // Recurse into subexpressions:
-        for(const auto &child: loop.children()) {
-            child->accept(*this);
+    try {
+        PassManager manager(passes, cell);
+        auto parsed = manager.run(program.view());
+        if (passes.time_passes) manager.report(std::cerr);
+        const Prefix& prefix = manager.prefix();
+
+        if (native) {
+            std::string source = CEmitter(cell, io).emit(parsed.expressions(), prefix);
+            auto code = NativeBackend(cache_dir, cache_size).compile(source);
+            return run(code->code());
         }
 
-        // 0000000000000067 loop_end:
-        //       67: 83 3f 00                      cmpl    $0, (%rdi)
-        //       6a: 0f 85 00 00 00 00             jne 0
-        buffer_.writes((uint8_t*)"\x83\x3f\x00", 3);
-        buffer_.writes((uint8_t*)"\x0f\x85", 2);
-        // Calculate how much to jump back (consider the 4 bytes
-        // of the operand itself):
-        uint32_t jump_back = after_loop_start - buffer_.get_ptr() - 4;
-        // Append the distance to the jump:
-        buffer_.writel(jump_back);
-
-        // Now calculate how much to jump forward in case we want
-        // to skip the loop, to fill the pending jump:
-        uint8_t *after_loop_end = buffer_.get_ptr();
-        uint32_t jump_fwd = after_loop_end - after_loop_start;
-
-        // Go back to the original position (-4), fill the pending
-        // jump distance and get back to the the current pos:
-        buffer_.set_ptr(after_loop_start - 4);
-        buffer_.writel(jump_fwd);
-        buffer_.set_ptr(after_loop_end);
-    }
-
-    void compile(const ExpressionVector& expressions) {
-        program_.start();
-
-        for(const auto &expression: expressions) {
-            expression->accept(*this);
+        std::unique_ptr<Profile> profile;
+        if (profiling.enabled) {
+            profile.reset(new Profile(parsed.expressions()));
         }
 
-        program_.finish();
-    }
-};
-
-int main(int argc, char *argv[]) {
-    std::ifstream ifs(argv[1]);
+        ExecutableBuffer buffer(JITCompiler::code_size(parsed.expressions(), prefix,
+                                                       profiling.enabled));
+        JITProgram jit_program(buffer, abi, cell, io);
+        JITCompiler compiler(jit_program, avx2, tuning);
 
-    if (!ifs) {
-        std::cerr << "Invalid filename!" << std::endl;
-        return 1;
-    }
+        std::unique_ptr<CodeMap> map;
+        if (debug.enabled()) {
+            std::unique_ptr<char, decltype(&free)> path(realpath(argv[arg], nullptr), &free);
+            map.reset(new CodeMap(path ? path.get() : argv[arg], program.view()));
+        }
 
-    std::vector<char> program;
+        compiler.profile(profile.get());
+        compiler.map(map.get());
+        compiler.compile(parsed.expressions(), prefix);
 
-    std::copy(
-        (std::istreambuf_iterator<char>(ifs)),
-        (std::istreambuf_iterator<char>()),
-        std::back_inserter(program)
-    );
+        if (elf) {
+            if (!jit_program.write_elf(elf)) {
+                perror(elf);
+                return 1;
+            }
+            return 0;
+        }
 
-    try {
-        auto expressions = Parser().parse(program);
+        cache.store(program.view(), options, buffer.get_base(), jit_program.size());
 
-        ExecutableBuffer buffer(1000000);
-        JITProgram jit_program(buffer);
-        JITCompiler compiler(jit_program);
+        JITProgram::Code code = jit_program.code();
+        const uint8_t* base = buffer.get_base();
 
-        compiler.compile(expressions);
+        std::unique_ptr<JitDump> jitdump;
+        std::unique_ptr<GDBRegistration> gdb;
+        if (debug.perf_map && !write_perf_map(*map, base)) {
+            perror("perf map");
+        }
+        if (debug.jitdump) {
+            jitdump.reset(new JitDump());
+            if (!*jitdump || !jitdump->add(*map, base)) {
+                perror(jitdump->path().c_str());
+            }
+        }
+        if (debug.gdb) {
+            gdb.reset(new GDBRegistration(*map, base));
+        }
 
-        jit_program.run();
+        int status = run(code);
+        if (profile) {
+            profiling.report(*profile, program.view(), prefix.steps);
+        }
+        return status;
 
     } catch (std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
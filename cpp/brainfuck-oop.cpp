@@ -1,28 +1,74 @@
-#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "brainfuck.h"
+#include "passes.h"
+#include "profile.h"
+#include "source.h"
+
+template <typename T>
+void run(IOPolicy io, const Prefix& prefix, const ExpressionList& expressions,
+         Profile* profile) {
+    Runner<T> runner(io);
+    runner.restore(prefix);
+    if (profile) {
+        ProfilingRunner<T>(runner, *profile).run(expressions);
+    } else {
+        runner.run(expressions);
+    }
+}
 
 int main(int argc, char *argv[]) {
-    std::ifstream ifs(argv[1]);
+    size_t cell = 4;
+    IOPolicy io;
+    PassOptions passes;
+    ProfileOptions profiling;
+    int arg = 1;
+
+    for (; arg < argc - 1; ++arg) {
+        std::string option(argv[arg]);
+        if (option == "--cell=8") {
+            cell = 1;
+        } else if (option == "--cell=16") {
+            cell = 2;
+        } else if (option == "--cell=32") {
+            cell = 4;
+        } else if (io.parse(option) || passes.parse(option) || profiling.parse(option)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
 
-    if (!ifs) {
+    SourceFile program(argv[arg]);
+
+    if (!program) {
         std::cerr << "Invalid filename!" << std::endl;
         return 1;
     }
 
-    std::vector<char> program;
+    try {
+        PassManager manager(passes, cell);
+        auto parsed = manager.run(program.view());
+        if (passes.time_passes) manager.report(std::cerr);
+
+        std::unique_ptr<Profile> profile;
+        if (profiling.enabled) {
+            profile.reset(new Profile(parsed.expressions()));
+        }
 
-    std::copy(
-        (std::istreambuf_iterator<char>(ifs)),
-        (std::istreambuf_iterator<char>()),
-        std::back_inserter(program)
-    );
+        switch (cell) {
+            case 1: run<uint8_t>(io, manager.prefix(), parsed.expressions(), profile.get()); break;
+            case 2: run<uint16_t>(io, manager.prefix(), parsed.expressions(), profile.get()); break;
+            default: run<uint32_t>(io, manager.prefix(), parsed.expressions(), profile.get()); break;
+        }
 
-    try {
-        auto expressions = Parser().parse(program);
-        Runner().run(expressions);
+        if (profile) {
+            profiling.report(*profile, program.view(), manager.prefix().steps);
+        }
     } catch (std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
     }
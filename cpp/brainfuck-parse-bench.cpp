@@ -0,0 +1,100 @@
+#include <chrono>
+#include <iostream>
+#include <new>
+
+#include <sys/resource.h>
+
+#include "brainfuck.h"
+#include "source.h"
+
+// Measures how long it takes to load a program and parse it for the
+// first time, to parse and optimize it (and to release it afterwards),
+// and how many heap allocations that takes.
+// Run it on a big program to see the effect of the IR layout, e.g.:
+//
+//   $ for i in $(seq 200); do cat ../programs/mandelbrot.bf; done > big.bf
+//   $ ./brainfuck-parse-bench big.bf
+
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+    if (void* ptr = malloc(size)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+    // Loading the source is just mapping it, its pages are read in by
+    // the first parse, so that one is measured on its own (as startup):
+    auto start = Clock::now();
+    SourceFile source(argv[1]);
+    double load_ms = elapsed_ms(start);
+
+    if (!source) {
+        std::cerr << "Invalid filename!" << std::endl;
+        return 1;
+    }
+
+    double startup_ms = 0;
+    try {
+        start = Clock::now();
+        Parser().parse(source.view());
+        startup_ms = load_ms + elapsed_ms(start);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    double parse_ms = 0, release_ms = 0;
+    size_t parse_allocations = 0, parse_bytes = 0;
+
+    try {
+        for (int i = 0; i < iterations; ++i) {
+            allocations = allocated_bytes = 0;
+
+            auto start = Clock::now();
+            auto program = OffsetFolder().rewrite(
+                IdiomRecognizer().rewrite(Parser().parse(source.view()))
+            );
+            parse_ms += elapsed_ms(start);
+            parse_allocations = allocations;
+            parse_bytes = allocated_bytes;
+
+            start = Clock::now();
+            {
+                auto released = std::move(program);
+            }
+            release_ms += elapsed_ms(start);
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::cout << "source:      " << source.view().size() << " bytes" << std::endl
+              << "load:        " << load_ms << " ms" << std::endl
+              << "startup:     " << startup_ms << " ms (load + first parse)" << std::endl
+              << "parse:       " << parse_ms / iterations << " ms" << std::endl
+              << "release:     " << release_ms / iterations << " ms" << std::endl
+              << "allocations: " << parse_allocations
+              << " (" << parse_bytes << " bytes)" << std::endl
+              << "peak RSS:    " << usage.ru_maxrss << " KB" << std::endl;
+
+    return 0;
+}
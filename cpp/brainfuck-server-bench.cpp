@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "passes.h"
+#include "source.h"
+
+// Sends jobs to brainfuck-server from a number of concurrent clients
+// and reports how many it ran per second and how long they took. Each
+// client runs the given programs in turn, with the same input, and
+// every output is compared with the first one of its program.
+//
+// With --exec=ENGINE it starts a process per job instead (as in
+// 'ENGINE program < input'), for comparison.
+
+using Clock = std::chrono::steady_clock;
+
+struct Job
+{
+    std::string path;
+    std::string source;
+    std::string expected;
+};
+
+struct Options
+{
+    std::string socket = "/tmp/brainfuck-server.sock";
+    std::string exec;
+    std::string input;
+    size_t clients = 4;
+    size_t requests = 1000;
+};
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* ptr = (const uint8_t*) data;
+    while (size > 0) {
+        ssize_t count = write(fd, ptr, size);
+        if (count < 0) return false;
+        ptr += count;
+        size -= count;
+    }
+    return true;
+}
+
+static bool read_all(int fd, std::string& output) {
+    char buffer[1 << 16];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, count);
+    }
+    return count == 0;
+}
+
+static bool run_remote(const Options& options, const Job& job, std::string& output) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, options.socket.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return false;
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        close(fd);
+        return false;
+    }
+
+    uint32_t size = job.source.size();
+    uint8_t header[4] = {uint8_t(size), uint8_t(size >> 8),
+                         uint8_t(size >> 16), uint8_t(size >> 24)};
+
+    // (the program doesn't have to read all of its input)
+    bool ok = write_all(fd, header, sizeof(header)) &&
+              write_all(fd, job.source.data(), job.source.size());
+    if (ok) {
+        write_all(fd, options.input.data(), options.input.size());
+        shutdown(fd, SHUT_WR);
+        ok = read_all(fd, output);
+    }
+    close(fd);
+    return ok;
+}
+
+static bool run_process(const Options& options, const Job& job, std::string& output) {
+    int out[2], in[2];
+    if (pipe(out) == -1) return false;
+    if (pipe(in) == -1) {
+        close(out[0]); close(out[1]);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, in[1]);
+    posix_spawn_file_actions_addclose(&actions, out[0]);
+
+    char* argv[] = {(char*) options.exec.c_str(), (char*) job.path.c_str(), nullptr};
+    pid_t pid;
+    int error = posix_spawn(&pid, argv[0], &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+
+    // (the program doesn't have to read all of its input, and inputs
+    // bigger than a pipe would need a separate writer)
+    if (error == 0) {
+        write_all(in[1], options.input.data(), options.input.size());
+    }
+    close(in[1]);
+    bool ok = error == 0 && read_all(out[0], output);
+    close(out[0]);
+
+    int status;
+    return ok && waitpid(pid, &status, 0) == pid;
+}
+
+static bool run(const Options& options, const Job& job, std::string& output) {
+    return options.exec.empty() ? run_remote(options, job, output)
+                                : run_process(options, job, output);
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    std::vector<Job> jobs;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option(argv[arg]);
+        if (option.compare(0, 9, "--socket=") == 0) {
+            options.socket = option.substr(9);
+        } else if (option.compare(0, 7, "--exec=") == 0) {
+            options.exec = option.substr(7);
+        } else if (option.compare(0, 10, "--clients=") == 0 &&
+                   parse_number(option.substr(10), options.clients)) {
+            options.clients = std::max<size_t>(1, options.clients);
+        } else if (option.compare(0, 11, "--requests=") == 0 &&
+                   parse_number(option.substr(11), options.requests)) {
+            options.requests = std::max<size_t>(1, options.requests);
+        } else if (option.compare(0, 8, "--input=") == 0) {
+            SourceFile input(option.substr(8).c_str());
+            if (!input) {
+                std::cerr << "Invalid input: " << option.substr(8) << std::endl;
+                return 1;
+            }
+            options.input = std::string(input.view());
+        } else if (option.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        } else {
+            SourceFile source(argv[arg]);
+            if (!source) {
+                std::cerr << "Invalid filename: " << option << std::endl;
+                return 1;
+            }
+            jobs.push_back({option, std::string(source.view()), ""});
+        }
+    }
+
+    if (jobs.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--socket=PATH|--exec=ENGINE]"
+                  << " [--clients=N] [--requests=N] [--input=FILE] program..."
+                  << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // The first run of each program is the reference (and leaves it
+    // compiled, so the measurements don't include that):
+    for (auto &job: jobs) {
+        if (!run(options, job, job.expected)) {
+            std::cerr << "Failed to run " << job.path << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::vector<double>> latencies(options.clients);
+    std::vector<size_t> failures(options.clients), mismatches(options.clients);
+    std::vector<std::thread> clients;
+
+    auto start = Clock::now();
+    for (size_t client = 0; client < options.clients; ++client) {
+        clients.emplace_back([&, client] {
+            for (size_t i = client; i < options.requests; i += options.clients) {
+                const Job& job = jobs[i % jobs.size()];
+                std::string output;
+
+                auto begin = Clock::now();
+                bool ok = run(options, job, output);
+                auto elapsed = std::chrono::duration<double, std::milli>(Clock::now() - begin);
+
+                latencies[client].push_back(elapsed.count());
+                if (!ok) {
+                    ++failures[client];
+                } else if (output != job.expected) {
+                    ++mismatches[client];
+                }
+            }
+        });
+    }
+    for (auto &client: clients) {
+        client.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::vector<double> all;
+    size_t failed = 0, mismatched = 0;
+    for (size_t client = 0; client < options.clients; ++client) {
+        all.insert(all.end(), latencies[client].begin(), latencies[client].end());
+        failed += failures[client];
+        mismatched += mismatches[client];
+    }
+    std::sort(all.begin(), all.end());
+
+    std::cout << "Jobs:       " << all.size() << " (" << options.clients << " clients)" << std::endl;
+    std::cout << "Throughput: " << all.size() / elapsed.count() << " jobs/s" << std::endl;
+    std::cout << "Latency:    p50 " << percentile(all, 0.5) << "ms, p99 "
+              << percentile(all, 0.99) << "ms, max " << all.back() << "ms" << std::endl;
+    std::cout << "Failures:   " << failed << std::endl;
+    std::cout << "Mismatches: " << mismatched << std::endl;
+
+    return failed || mismatched ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "brainfuck.h"
+#include "cache.h"
+#include "jit.h"
+#include "passes.h"
+
+// A long-running process that runs programs for its clients, so that
+// running many short jobs doesn't pay for starting a process, parsing
+// and compiling each time. It listens on a Unix domain socket, and
+// each connection is a job:
+//
+//   client: | program size (4 bytes, little-endian) | program | input ...
+//   server: | output ... |
+//
+// The client shuts down its side of the connection once the input is
+// sent (that's the EOF the program sees), and the server closes the
+// connection once the program is done. Programs are parsed and compiled
+// once, and kept in an LRU cache keyed by their source, so jobs that
+// run the same program only pay for running it. Each job runs on one
+// of the worker threads, with its own tape and I/O buffers (reading
+// from and writing to the connection), so the compiled code is shared
+// and never written to.
+//
+// A program that goes out of its tape only ends its own job (with an
+// error sent to the client after its output), and so does one that
+// runs past the time limit: a watchdog thread sends its worker a
+// signal, and the handler leaves the program through the same
+// Tape::recover() as a fault does.
+
+// A program ready to run. Shared (read-only) by all the jobs running
+// it, and kept alive by them after being evicted from the cache:
+struct CompiledProgram
+{
+    std::string source;
+    Program program;
+    Prefix prefix;
+    std::unique_ptr<ExecutableBuffer> buffer;   // (only with the JIT)
+    JITProgram::Code code = nullptr;
+
+    CompiledProgram(std::string source, Program&& program, Prefix prefix)
+     : source(std::move(source)),
+       program(std::move(program)),
+       prefix(std::move(prefix)) {}
+};
+
+using CompiledProgramPtr = std::shared_ptr<const CompiledProgram>;
+
+// The most recently used programs, by hash (the source is compared
+// too, so a collision is just a miss):
+class ProgramCache
+{
+private:
+    using Entry = std::pair<uint64_t, CompiledProgramPtr>;
+
+    size_t capacity_;
+    std::mutex mutex_;
+    std::list<Entry> entries_;      // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+
+public:
+    ProgramCache(size_t capacity) : capacity_(capacity) {}
+
+    static uint64_t hash(const std::string& source) {
+        return fnv1a(source.data(), source.size());
+    }
+
+    CompiledProgramPtr lookup(const std::string& source) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = index_.find(hash(source));
+        if (it == index_.end() || it->second->second->source != source) {
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->second;
+    }
+
+    void store(CompiledProgramPtr program) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        uint64_t key = hash(program->source);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            entries_.erase(it->second);
+        }
+        entries_.emplace_front(key, std::move(program));
+        index_[key] = entries_.begin();
+
+        while (entries_.size() > capacity_) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+};
+
+struct ServerOptions
+{
+    bool jit = true;
+    size_t cell = 4;
+    bool avx2 = has_avx2();
+    JITTuning tuning;
+    PassOptions passes;
+    IOPolicy io;
+    size_t time_limit = 10000;  // (per job, in ms, 0 for none)
+};
+
+class Server
+{
+private:
+    static const size_t MaxProgramSize = 16 << 20;
+    static const int TimeoutSignal = SIGUSR1;
+
+    struct Worker {
+        std::thread thread;
+        // When the job it runs is out of time (0 if there's no job, or
+        // no limit), in ns (see now()):
+        std::atomic<int64_t> deadline{0};
+    };
+
+    ServerOptions options_;
+    ProgramCache cache_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<int> connections_;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+public:
+    Server(ServerOptions options, size_t cache_entries)
+     : options_(options), cache_(cache_entries) {}
+
+    void serve(int listener, size_t threads) {
+        // (restarting whatever a late signal interrupts outside of a job)
+        struct sigaction action = {};
+        action.sa_handler = timeout;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(TimeoutSignal, &action, nullptr);
+
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back(new Worker());
+        }
+        for (auto &worker: workers_) {
+            Worker* self = worker.get();
+            worker->thread = std::thread([this, self] {work(*self);});
+        }
+        if (options_.time_limit) {
+            std::thread([this] {watch();}).detach();
+        }
+
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd == -1) {
+                if (errno == EINTR) continue;
+                perror("accept");
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            connections_.push_back(fd);
+            ready_.notify_one();
+        }
+
+        // (the workers never end, so neither does the server)
+        for (auto &worker: workers_) {
+            worker->thread.join();
+        }
+    }
+
+private:
+    // A monotonic clock, in ns, that the signal handler can read too
+    // (clock_gettime() is async-signal-safe):
+    static int64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // (the deadline of the worker running on this thread)
+    static std::atomic<int64_t>*& deadline() {
+        static thread_local std::atomic<int64_t>* deadline = nullptr;
+        return deadline;
+    }
+
+    // A signal that comes after the job it was sent for (when the
+    // worker is idle, or running the next one) is ignored:
+    static void timeout(int) {
+        std::atomic<int64_t>* deadline = Server::deadline();
+        if (!deadline) return;
+        int64_t limit = deadline->load();
+        if (limit && now() >= limit) Tape::interrupt();
+    }
+
+    // Signals the workers whose job is out of time, again and again
+    // until they're done with it (in case one of the signals came
+    // before the job was inside Tape::recover()):
+    void watch() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            int64_t time = now();
+            for (auto &worker: workers_) {
+                int64_t limit = worker->deadline.load();
+                if (limit && time >= limit) {
+                    pthread_kill(worker->thread.native_handle(), TimeoutSignal);
+                }
+            }
+        }
+    }
+
+    void work(Worker& worker) {
+        deadline() = &worker.deadline;
+        while (true) {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] {return !connections_.empty();});
+                fd = connections_.front();
+                connections_.pop_front();
+            }
+            handle(fd);
+            finish(fd);
+        }
+    }
+
+    // Ends the output, and discards the input the program didn't read
+    // before closing (closing with unread data resets the connection,
+    // and the client could lose the end of the output):
+    static void finish(int fd) {
+        shutdown(fd, SHUT_WR);
+
+        char buffer[4096];
+        while (read(fd, buffer, sizeof(buffer)) > 0) {}
+        close(fd);
+    }
+
+    void handle(int fd) {
+        std::string source;
+        if (!read_program(fd, source)) return;
+
+        try {
+            CompiledProgramPtr program = cache_.lookup(source);
+            if (!program) {
+                program = compile(std::move(source));
+                cache_.store(program);
+            }
+            run(*program, fd);
+        } catch (std::exception& e) {
+            std::string message = std::string("Error: ") + e.what() + "\n";
+            if (write(fd, message.data(), message.size()) < 0) {}
+        }
+    }
+
+    static bool read_all(int fd, void* data, size_t size) {
+        uint8_t* ptr = (uint8_t*) data;
+        while (size > 0) {
+            ssize_t count = read(fd, ptr, size);
+            if (count <= 0) return false;
+            ptr += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    static bool read_program(int fd, std::string& source) {
+        uint8_t header[4];
+        if (!read_all(fd, header, sizeof(header))) return false;
+
+        size_t size = header[0] | header[1] << 8 | header[2] << 16 |
+                      uint32_t(header[3]) << 24;
+        if (size > MaxProgramSize) return false;
+
+        source.resize(size);
+        return read_all(fd, &source[0], size);
+    }
+
+    CompiledProgramPtr compile(std::string source) {
+        PassManager manager(options_.passes, options_.cell);
+        auto parsed = manager.run(source);
+        if (options_.passes.time_passes) manager.report(std::cerr);
+        std::shared_ptr<CompiledProgram> compiled(new CompiledProgram(
+            std::move(source), std::move(parsed), manager.prefix()
+        ));
+
+        if (options_.jit) {
+            const ExpressionList& expressions = compiled->program.expressions();
+            compiled->buffer.reset(new ExecutableBuffer(
+                JITCompiler::code_size(expressions, compiled->prefix)
+            ));
+            JITProgram jit_program(*compiled->buffer, NativeABI,
+                                   options_.cell, options_.io);
+            JITCompiler(jit_program, options_.avx2, options_.tuning)
+                .compile(expressions, compiled->prefix);
+            compiled->code = jit_program.code();
+        }
+
+        return compiled;
+    }
+
+    void run(const CompiledProgram& program, int fd) {
+        int64_t limit = options_.time_limit ?
+                        now() + int64_t(options_.time_limit) * 1000000 : 0;
+        deadline()->store(limit);
+
+        bool finished;
+        if (program.code) {
+            finished = JITProgram::execute(program.code, options_.cell, options_.io, fd, fd);
+        } else {
+            switch (options_.cell) {
+                case 1: finished = interpret<uint8_t>(program, fd); break;
+                case 2: finished = interpret<uint16_t>(program, fd); break;
+                default: finished = interpret<uint32_t>(program, fd); break;
+            }
+        }
+
+        deadline()->store(0);
+        if (!finished) {
+            throw std::runtime_error(limit && now() >= limit ? "time limit exceeded"
+                                                             : "out of the tape");
+        }
+    }
+
+    template <typename T>
+    bool interpret(const CompiledProgram& program, int fd) {
+        std::unique_ptr<Runner<T>> runner(new Runner<T>(options_.io, fd, fd));
+        runner->restore(program.prefix);
+        return Tape::recover([&] {runner->run(program.program.expressions());});
+    }
+};
+
+int main(int argc, char *argv[]) {
+    ServerOptions options;
+    std::string path = "/tmp/brainfuck-server.sock";
+    size_t threads = std::min<size_t>(Tape::MaxTapes,
+                                      std::max(1u, std::thread::hardware_concurrency()));
+    size_t cache_entries = 256;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option(argv[arg]);
+        if (option.compare(0, 9, "--socket=") == 0) {
+            path = option.substr(9);
+        } else if (option.compare(0, 10, "--threads=") == 0 &&
+                   parse_number(option.substr(10), threads, Tape::MaxTapes)) {
+            // (each worker has a tape while it runs a job)
+            threads = std::max<size_t>(1, threads);
+        } else if (option.compare(0, 13, "--time-limit=") == 0 &&
+                   parse_number(option.substr(13), options.time_limit, INT32_MAX)) {
+            continue;
+        } else if (option.compare(0, 16, "--cache-entries=") == 0 &&
+                   parse_number(option.substr(16), cache_entries)) {
+            cache_entries = std::max<size_t>(1, cache_entries);
+        } else if (option == "--engine=jit") {
+            options.jit = true;
+        } else if (option == "--engine=oop") {
+            options.jit = false;
+        } else if (option == "--cell=8") {
+            options.cell = 1;
+        } else if (option == "--cell=16") {
+            options.cell = 2;
+        } else if (option == "--cell=32") {
+            options.cell = 4;
+        } else if (option == "--no-avx2") {
+            options.avx2 = false;
+        } else if (options.io.parse(option) || options.passes.parse(option) ||
+                   options.tuning.parse(option)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    // Clients that go away early make writes fail instead:
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener == -1 ||
+        bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(listener, 1024) == -1) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    std::cerr << "Listening on " << path << " (" << threads << " threads)"
+              << std::endl;
+
+    Server(options, cache_entries).serve(listener, threads);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <string>
+
+#include "brainfuck.h"
+#include "passes.h"
+#include "source.h"
+#include "threaded.h"
+
+int main(int argc, char *argv[]) {
+    size_t cell = 4;
+    IOPolicy io;
+    PassOptions passes;
+    int arg = 1;
+
+    for (; arg < argc - 1; ++arg) {
+        std::string option(argv[arg]);
+        if (option == "--cell=8") {
+            cell = 1;
+        } else if (option == "--cell=16") {
+            cell = 2;
+        } else if (option == "--cell=32") {
+            cell = 4;
+        } else if (io.parse(option) || passes.parse(option)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    SourceFile program(argv[arg]);
+
+    if (!program) {
+        std::cerr << "Invalid filename!" << std::endl;
+        return 1;
+    }
+
+    try {
+        PassManager manager(passes, cell);
+        auto parsed = manager.run(program.view());
+        if (passes.time_passes) manager.report(std::cerr);
+        auto code = BytecodeCompiler().compile(parsed.expressions());
+        const Prefix& prefix = manager.prefix();
+
+        switch (cell) {
+            case 1: ThreadedRunner(io).run<uint8_t>(code, prefix); break;
+            case 2: ThreadedRunner(io).run<uint16_t>(code, prefix); break;
+            default: ThreadedRunner(io).run<uint32_t>(code, prefix); break;
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <iostream>
+#include <string>
+
+#include "brainfuck.h"
+#include "jit.h"
+#include "passes.h"
+#include "source.h"
+#include "tiered.h"
+
+int main(int argc, char *argv[]) {
+    size_t cell = 4;
+    size_t threshold = 1000;
+    bool avx2 = has_avx2();
+    IOPolicy io;
+    PassOptions passes;
+    JITTuning tuning;
+    int arg = 1;
+
+    for (; arg < argc - 1; ++arg) {
+        std::string option(argv[arg]);
+        if (option == "--cell=8") {
+            cell = 1;
+        } else if (option == "--cell=16") {
+            cell = 2;
+        } else if (option == "--cell=32") {
+            cell = 4;
+        } else if (option.compare(0, 12, "--threshold=") == 0 &&
+                   parse_number(option.substr(12), threshold)) {
+            continue;
+        } else if (option == "--no-avx2") {
+            avx2 = false;
+        } else if (io.parse(option) || passes.parse(option) || tuning.parse(option)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    SourceFile program(argv[arg]);
+
+    if (!program) {
+        std::cerr << "Invalid filename!" << std::endl;
+        return 1;
+    }
+
+    try {
+        PassManager manager(passes, cell);
+        auto parsed = manager.run(program.view());
+        if (passes.time_passes) manager.report(std::cerr);
+        const Prefix& prefix = manager.prefix();
+
+        switch (cell) {
+            case 1: TieredRunner<uint8_t>(io, threshold, avx2, tuning).run(parsed.expressions(), prefix); break;
+            case 2: TieredRunner<uint16_t>(io, threshold, avx2, tuning).run(parsed.expressions(), prefix); break;
+            default: TieredRunner<uint32_t>(io, threshold, avx2, tuning).run(parsed.expressions(), prefix); break;
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
@@ -1,26 +1,77 @@
-#include <array>
+#ifndef BRAINFUCK_H
+#define BRAINFUCK_H
+
+#include <algorithm>
+#include <cstdint>
 #include <exception>
 #include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "io.h"
+#include "scan.h"
+#include "tape.h"
+
+// The state a program is in after running its beginning at compile
+// time (see PartialEvaluator): what it wrote, the tape from the first
+// cell on (the rest is still zero) and where the pointer is. Runners
+// start from it instead of from a blank tape:
+struct Prefix
+{
+    std::string output;
+    std::vector<uint32_t> cells;
+    ssize_t position = 0;
+
+    // Nodes run, and whether that was the whole program:
+    size_t steps = 0;
+    bool complete = false;
+
+    // Writes the cells to 'tape' (its first cell) and returns the
+    // pointer to the current one:
+    template <typename T> T* restore(T* tape) const {
+        std::copy(cells.begin(), cells.end(), tape);
+        return tape + position;
+    }
+};
+
 template <typename T=unsigned int>
 class Memory 
 {
 private:
-    std::array<T, 30000> memory_;
-    typename decltype(memory_)::iterator ptr_;
+    Tape tape_;
+    T* ptr_;
 
 public:
-    Memory() : memory_(), ptr_(memory_.begin()) {}
+    // (the tape grows past the initial 30000 cells if needed)
+    Memory() : tape_(30000 * sizeof(T)), ptr_(tape_.begin<T>()) {}
     ~Memory() = default;
 
-    inline void inc(T offset)       { *this->ptr_ += offset; }
-    inline void dec(T offset)       { *this->ptr_ -= offset; }
+    void restore(const Prefix& prefix) {ptr_ = prefix.restore(tape_.begin<T>());}
+
+    // 'at' is the position of the cell relative to the pointer:
+    inline void inc(T offset, ssize_t at=0) { this->ptr_[at] += offset; }
+    inline void dec(T offset, ssize_t at=0) { this->ptr_[at] -= offset; }
     inline void fwd(ssize_t offset) {  this->ptr_ += offset; }
     inline void bwd(ssize_t offset) {  this->ptr_ -= offset; }
 
-    inline T read() const { return *this->ptr_; }
-    inline void write(T c) { *this->ptr_=c; }
+    inline T read(ssize_t at=0) const { return this->ptr_[at]; }
+    inline void write(T c, ssize_t at=0) { this->ptr_[at]=c; }
+
+    inline void clear(ssize_t at=0) { this->ptr_[at] = 0; }
+    inline void scan_fwd(ssize_t stride) {
+        this->ptr_ = ::scan_fwd(this->ptr_, tape_.end<T>(), stride);
+    }
+    inline void scan_bwd(ssize_t stride) {
+        this->ptr_ = ::scan_bwd(this->ptr_, tape_.begin<T>(), stride);
+    }
+    inline void muladd(ssize_t offset, T factor, ssize_t at=0) {
+        // (multiplied as unsigned ints: 16-bit cells would otherwise be
+        // promoted to int, and could overflow)
+        this->ptr_[at + offset] += uint32_t(this->ptr_[at]) * uint32_t(factor);
+    }
 };
 
 class Increment;
@@ -30,6 +81,10 @@ class Backward;
 class Input;
 class Output;
 class Loop;
+class SetZero;
+class ScanLeft;
+class ScanRight;
+class MulAdd;
 
 class ExpressionVisitor
 {
@@ -41,146 +96,374 @@ public:
     virtual void visit(const Input&) = 0;
     virtual void visit(const Output&) = 0;
     virtual void visit(const Loop&) = 0;
+    virtual void visit(const SetZero&) = 0;
+    virtual void visit(const ScanLeft&) = 0;
+    virtual void visit(const ScanRight&) = 0;
+    virtual void visit(const MulAdd&) = 0;
 };
 
-class Runner;
+template <typename T> class Runner;
+
+// The cell width is picked at startup, so there's one run() for each
+// of the supported widths. Every node also knows where it comes from
+// in the source (the offset of its first character, or of the '[' of
+// the loop it replaces), for the profiler. (It's a whole size_t, so
+// sources of 4GB or more don't wrap around; with the vtable pointer
+// before it, it takes no more room than a uint32_t would.)
 class Expression
 {
+private:
+    size_t position_ = 0;
+
 public:
     Expression() {}
     virtual ~Expression() {}
 
-    virtual void run(Runner& runner) const = 0;
+    size_t position() const {return position_;}
+    void position(size_t position) {position_ = position;}
+
+    virtual void run(Runner<uint8_t>& runner) const = 0;
+    virtual void run(Runner<uint16_t>& runner) const = 0;
+    virtual void run(Runner<uint32_t>& runner) const = 0;
     virtual void accept(ExpressionVisitor& visitor) const = 0;
     virtual bool repeatable() const {return false;}
     virtual void repeat() {}
 };
 
-using ExpressionPtr = std::unique_ptr<Expression>;
+// Implements the virtual methods of Expression in terms of the
+// node's (non-virtual) execute<T>() template, and its type:
+template <typename Derived>
+class ExpressionImpl : public Expression
+{
+public:
+    virtual void run(Runner<uint8_t>& runner) const {derived().execute(runner);}
+    virtual void run(Runner<uint16_t>& runner) const {derived().execute(runner);}
+    virtual void run(Runner<uint32_t>& runner) const {derived().execute(runner);}
+    virtual void accept(ExpressionVisitor& visitor) const {visitor.visit(derived());}
+
+private:
+    const Derived& derived() const {return static_cast<const Derived&>(*this);}
+};
+
+// Nodes are owned by the Program they belong to (see below), so
+// everywhere else they are just plain pointers:
+using ExpressionPtr = Expression*;
 using ExpressionVector = std::vector<ExpressionPtr>;
 
+// The children of a loop (or the top level of a program): a range of
+// contiguous node pointers, allocated in the program's arena.
+class ExpressionList
+{
+private:
+    ExpressionPtr* begin_;
+    size_t size_;
+
+public:
+    ExpressionList() : begin_(nullptr), size_(0) {}
+    ExpressionList(ExpressionPtr* begin, size_t size)
+     : begin_(begin), size_(size) {}
+
+    ExpressionPtr* begin() const {return begin_;}
+    ExpressionPtr* end() const {return begin_ + size_;}
+    size_t size() const {return size_;}
+    bool empty() const {return size_ == 0;}
+
+    ExpressionPtr front() const {return begin_[0];}
+    ExpressionPtr back() const {return begin_[size_ - 1];}
+    ExpressionPtr operator[](size_t i) const {return begin_[i];}
+};
+
+// Bump allocator: memory is carved out of big blocks, and it's only
+// given back (all at once) when the arena is destroyed.
+class Arena
+{
+private:
+    static constexpr size_t BlockSize = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    uintptr_t next_;
+    uintptr_t end_;
+
+    void grow(size_t size) {
+        size = std::max(size, BlockSize);
+        blocks_.emplace_back(new char[size]);
+        next_ = reinterpret_cast<uintptr_t>(blocks_.back().get());
+        end_ = next_ + size;
+    }
+
+public:
+    Arena() : blocks_(), next_(0), end_(0) {}
+    ~Arena() = default;
+
+    Arena(const Arena&) = delete;
+    Arena(Arena&& other)
+     : blocks_(std::move(other.blocks_)), next_(other.next_), end_(other.end_) {
+        other.next_ = other.end_ = 0;
+    }
+    Arena& operator=(Arena&& other) {
+        blocks_ = std::move(other.blocks_);
+        next_ = other.next_;
+        end_ = other.end_;
+        other.next_ = other.end_ = 0;
+        return *this;
+    }
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t ptr = (next_ + align - 1) & ~(align - 1);
+        if (ptr + size > end_) {
+            grow(size + align);
+            ptr = (next_ + align - 1) & ~(align - 1);
+        }
+        next_ = ptr + size;
+        return reinterpret_cast<void*>(ptr);
+    }
+};
+
+// The IR of a whole program. Every node and every list of children is
+// allocated in its arena, so building the tree takes a handful of
+// allocations and releasing it is just freeing the arena blocks (the
+// destructors of the nodes are never called, so they must not own
+// any resources).
+class Program
+{
+private:
+    Arena arena_;
+    ExpressionList expressions_;
+
+public:
+    Program() = default;
+    ~Program() = default;
+
+    Program(const Program&) = delete;
+    Program(Program&&) = default;
+    Program& operator=(Program&&) = default;
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        void* ptr = arena_.allocate(sizeof(T), alignof(T));
+        return new (ptr) T(std::forward<Args>(args)...);
+    }
+
+    // The same, for a node that replaces 'origin' (and takes its
+    // position in the source):
+    template <typename T, typename... Args>
+    T* make_from(const Expression* origin, Args&&... args) {
+        T* node = make<T>(std::forward<Args>(args)...);
+        node->position(origin->position());
+        return node;
+    }
+
+    // Moves the nodes from 'start' to the end of 'pending' into a new
+    // list. Passes build all their lists on top of the same vector,
+    // so it ends up being reused for the whole tree:
+    ExpressionList list(ExpressionVector& pending, size_t start) {
+        size_t size = pending.size() - start;
+        auto nodes = static_cast<ExpressionPtr*>(
+            arena_.allocate(size * sizeof(ExpressionPtr), alignof(ExpressionPtr))
+        );
+        std::copy(pending.begin() + start, pending.end(), nodes);
+        pending.resize(start);
+        return ExpressionList(nodes, size);
+    }
+
+    const ExpressionList& expressions() const {return expressions_;}
+    void expressions(ExpressionList expressions) {expressions_ = expressions;}
+};
+
+template <typename T>
 class Runner {
 private:
-    Memory<> memory_;
+    Memory<T> memory_;
+    IOContext io_;
 
 public:
-    Runner() = default;
+    Runner(IOPolicy policy = IOPolicy(),
+           int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO)
+     : memory_(), io_(policy, in_fd, out_fd) {}
     ~Runner() = default;
 
-    inline Memory<>& memory() {return memory_;};
+    inline Memory<T>& memory() {return memory_;};
+    inline IOContext& io() {return io_;};
+
+    void restore(const Prefix& prefix) {
+        io_.write(prefix.output.data(), prefix.output.size());
+        memory_.restore(prefix);
+    }
+
+    void run(const ExpressionList& expressions) {
+        try {
+            execute(expressions);
+        } catch (const EndOfInput&) {
+            // The input is over, and so is the program
+        }
+    }
 
-    void run(const ExpressionVector& expressions) {
+    void execute(const ExpressionList& expressions) {
         for(const auto &expression: expressions) {
             expression->run(*this);
         }
     }
 };
 
-class Increment : public Expression
+class Increment : public ExpressionImpl<Increment>
 {
 private:
     ssize_t offset_;
+    ssize_t at_;
 public:
-    Increment(ssize_t offset) : Expression(), offset_(offset) {}
-    virtual void run(Runner& runner) const {runner.memory().inc(offset_);}
-    virtual void accept(ExpressionVisitor& visitor) const {visitor.visit(*this);}
+    Increment(ssize_t offset, ssize_t at=0) : ExpressionImpl(), offset_(offset), at_(at) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().inc(offset_, at_);}
     virtual bool repeatable() const {return true;}
     virtual void repeat() {++offset_;}
     ssize_t offset() const {return offset_;}
+    ssize_t at() const {return at_;}
 };
 
-class Decrement : public Expression
+class Decrement : public ExpressionImpl<Decrement>
 {
 private:
     ssize_t offset_;
+    ssize_t at_;
 public:
-    Decrement(ssize_t offset) : Expression(), offset_(offset) {}
-    virtual void run(Runner& runner) const {runner.memory().dec(offset_);}
-    virtual void accept(ExpressionVisitor& visitor) const {visitor.visit(*this);}
+    Decrement(ssize_t offset, ssize_t at=0) : ExpressionImpl(), offset_(offset), at_(at) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().dec(offset_, at_);}
     virtual bool repeatable() const {return true;}
     virtual void repeat() {++offset_;}
     ssize_t offset() const {return offset_;}
+    ssize_t at() const {return at_;}
 };
 
-class Forward : public Expression
+class Forward : public ExpressionImpl<Forward>
 {
 private:
     ssize_t offset_;
 public:
-    Forward(ssize_t offset) : Expression(), offset_(offset) {}
-    virtual void run(Runner& runner) const {runner.memory().fwd(offset_);}
-    virtual void accept(ExpressionVisitor& visitor) const {visitor.visit(*this);}
+    Forward(ssize_t offset) : ExpressionImpl(), offset_(offset) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().fwd(offset_);}
     virtual bool repeatable() const {return true;}
     virtual void repeat() {++offset_;}
     ssize_t offset() const {return offset_;}
 };
 
-class Backward : public Expression
+class Backward : public ExpressionImpl<Backward>
 {
 private:
     ssize_t offset_;
 public:
-    Backward(ssize_t offset) : Expression(), offset_(offset) {}
-    virtual void run(Runner& runner) const {runner.memory().bwd(offset_);}
-    virtual void accept(ExpressionVisitor& visitor) const {visitor.visit(*this);}
+    Backward(ssize_t offset) : ExpressionImpl(), offset_(offset) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().bwd(offset_);}
     virtual bool repeatable() const {return true;}
     virtual void repeat() {++offset_;}
     ssize_t offset() const {return offset_;}
 };
 
-class Input : public Expression
+class Input : public ExpressionImpl<Input>
 {
+private:
+    ssize_t at_;
+
 public:
-    virtual void run(Runner& runner) const {
-        runner.memory().write(getchar());
-        if (runner.memory().read() == EOF)
-            exit(0);
-    }
+    Input(ssize_t at=0) : ExpressionImpl(), at_(at) {}
 
-    virtual void accept(ExpressionVisitor& visitor) const {
-        visitor.visit(*this);
+    template <typename T> void execute(Runner<T>& runner) const {
+        int c;
+        if (runner.io().read(c))
+            runner.memory().write(c, at_);
     }
+
+    ssize_t at() const {return at_;}
 };
 
-class Output : public Expression
+class Output : public ExpressionImpl<Output>
 {
+private:
+    ssize_t at_;
+
 public:
-    virtual void run(Runner& runner) const {
-        putchar(runner.memory().read()); 
-        fflush(stdout); 
-    }
+    Output(ssize_t at=0) : ExpressionImpl(), at_(at) {}
 
-    virtual void accept(ExpressionVisitor& visitor) const {
-        visitor.visit(*this);
+    template <typename T> void execute(Runner<T>& runner) const {
+        runner.io().write(runner.memory().read(at_));
     }
+
+    ssize_t at() const {return at_;}
 };
 
-class Loop : public Expression
+class Loop : public ExpressionImpl<Loop>
 {
 private:
-    ExpressionVector children_;
+    ExpressionList children_;
 
 public:
-    Loop(ExpressionVector &&children)
-     : Expression(),
-       children_(std::move(children)) {}
+    Loop(ExpressionList children)
+     : ExpressionImpl(),
+       children_(children) {}
 
     Loop(const Loop&) = delete;
 
-    const ExpressionVector& children() const {return children_;}
+    const ExpressionList& children() const {return children_;}
+    void children(ExpressionList children) {children_ = children;}
 
-    virtual void run(Runner& runner) const {
+    template <typename T> void execute(Runner<T>& runner) const {
         while(runner.memory().read() > 0) {
-            runner.run(children_);
+            runner.execute(children_);
         }
     }
+};
 
-    virtual void accept(ExpressionVisitor& visitor) const {
-        visitor.visit(*this);
-    }
+// The nodes below are never produced by the Parser, but by the
+// IdiomRecognizer, which replaces common loops with them.
+
+// [-] or [+]
+class SetZero : public ExpressionImpl<SetZero>
+{
+private:
+    ssize_t at_;
+public:
+    SetZero(ssize_t at=0) : ExpressionImpl(), at_(at) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().clear(at_);}
+    ssize_t at() const {return at_;}
 };
 
-using TokenVector = std::vector<char>;
+// [<], [<<], ...
+class ScanLeft : public ExpressionImpl<ScanLeft>
+{
+private:
+    ssize_t stride_;
+public:
+    ScanLeft(ssize_t stride) : ExpressionImpl(), stride_(stride) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().scan_bwd(stride_);}
+    ssize_t stride() const {return stride_;}
+};
+
+// [>], [>>], ...
+class ScanRight : public ExpressionImpl<ScanRight>
+{
+private:
+    ssize_t stride_;
+public:
+    ScanRight(ssize_t stride) : ExpressionImpl(), stride_(stride) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().scan_fwd(stride_);}
+    ssize_t stride() const {return stride_;}
+};
+
+// Adds the current cell times 'factor' to the cell at 'offset'. A
+// loop like [->+>++<<] becomes MulAdd(1, 1), MulAdd(2, 2), SetZero.
+// ('offset' is relative to the source cell, which is at 'at')
+class MulAdd : public ExpressionImpl<MulAdd>
+{
+private:
+    ssize_t offset_;
+    ssize_t factor_;
+    ssize_t at_;
+public:
+    MulAdd(ssize_t offset, ssize_t factor, ssize_t at=0)
+     : ExpressionImpl(), offset_(offset), factor_(factor), at_(at) {}
+    template <typename T> void execute(Runner<T>& runner) const {runner.memory().muladd(offset_, factor_, at_);}
+    ssize_t offset() const {return offset_;}
+    ssize_t factor() const {return factor_;}
+    ssize_t at() const {return at_;}
+};
 
 class ExcessiveOpeningBrackets: public std::exception {
     virtual const char* what() const throw() {
@@ -200,49 +483,590 @@ public:
     Parser() = default;
     ~Parser() = default;
     
-    ExpressionVector parse(TokenVector&);
+    Program parse(std::string_view);
 };
 
-ExpressionVector Parser::parse(TokenVector& tokens) {
-    using ExpressionVectorPtr = std::unique_ptr<ExpressionVector>;
+Program Parser::parse(std::string_view source) {
+    Program program;
 
-    std::vector<ExpressionVectorPtr> stack;
-    ExpressionVectorPtr expressions(new ExpressionVector());
+    // The nodes of all the loops being parsed, innermost last, and
+    // where the children of each of those loops start (and where they
+    // start in the source):
+    ExpressionVector pending;
+    std::vector<size_t> starts;
+    std::vector<size_t> positions;
 
-    for (auto token: tokens) {
-        ExpressionPtr next;
+    // Last operation seen in the current loop, if it can be repeated:
+    char previous = 0;
+
+    for (size_t position = 0; position < source.size(); ++position) {
+        char token = source[position];
+        ExpressionPtr next = nullptr;
+        size_t at = position;
+
+        if (token == previous) {
+            pending.back()->repeat();
+            continue;
+        }
 
         switch(token) {
-            case '+': next = ExpressionPtr(new Increment(1)); break;
-            case '-': next = ExpressionPtr(new Decrement(1)); break;
-            case '>': next = ExpressionPtr(new Forward(1));   break;
-            case '<': next = ExpressionPtr(new Backward(1));  break;
-            case ',': next = ExpressionPtr(new Input());      break;
-            case '.': next = ExpressionPtr(new Output());     break;
+            case '+': next = program.make<Increment>(1); break;
+            case '-': next = program.make<Decrement>(1); break;
+            case '>': next = program.make<Forward>(1);   break;
+            case '<': next = program.make<Backward>(1);  break;
+            case ',': next = program.make<Input>();      break;
+            case '.': next = program.make<Output>();     break;
             case '[':
-                stack.push_back(std::move(expressions));
-                expressions = ExpressionVectorPtr(new ExpressionVector());
+                starts.push_back(pending.size());
+                positions.push_back(position);
                 break;
             case ']':
-                if (stack.empty()) throw UnexpectedClosingBracket();
-                next = ExpressionPtr(new Loop(std::move(*expressions)));
-                expressions = std::move(stack.back());
-                stack.pop_back();
+                if (starts.empty()) throw UnexpectedClosingBracket();
+                next = program.make<Loop>(program.list(pending, starts.back()));
+                at = positions.back();
+                starts.pop_back();
+                positions.pop_back();
                 break;
+            default:
+                continue;
         }
 
-        if (!next) {
+        previous = next && next->repeatable() ? token : 0;
+
+        if (next) {
+            next->position(at);
+            pending.push_back(next);
+        }
+    }
+
+    if (!starts.empty()) throw ExcessiveOpeningBrackets();
+
+    program.expressions(program.list(pending, 0));
+
+    return program;
+}
+
+// The parser only folds runs of the same operation, so this folds
+// consecutive additions to the same cell and consecutive moves into
+// their net value ('+-+-', '><' and '+++---' are gone, '++-' is a
+// single +1), and removes the nodes that can't do anything because
+// the cell they depend on is known to be zero: loops right after
+// another loop (or a scan, or a clear) ends, and everything that
+// reads a cell before anything was written, like the comment loops
+// at the start of many programs. The code around a dead loop is
+// folded again once it's gone, so '>[...]<' disappears too.
+class Simplifier
+{
+public:
+    Simplifier() = default;
+    ~Simplifier() = default;
+
+    Program rewrite(Program&&);
+
+    // Nodes removed (a loop counts along with all its nodes):
+    size_t removed() const {return removed_;}
+
+private:
+    ExpressionVector pending_;
+    size_t removed_ = 0;
+
+    // What's known about the cells at the current point: whether the
+    // current one is zero, and whether all of them are (only at the
+    // beginning of the program):
+    bool zero_ = false;
+    bool all_zero_ = false;
+
+    // The net addition to the cell at 'add_at_' and the net move not
+    // emitted yet (at most one of them is non-zero), and the first of
+    // the nodes each one comes from:
+    ssize_t add_ = 0, add_at_ = 0, move_ = 0;
+    const Expression* add_origin_ = nullptr;
+    const Expression* move_origin_ = nullptr;
+
+    ExpressionList rewrite(Program&, const ExpressionList&);
+    void add(Program&, const Expression*, ssize_t value, ssize_t at);
+    void move(Program&, const Expression*, ssize_t value);
+    void flush(Program&);
+    bool dead(const Expression*) const;
+    void remove(const Expression*);
+};
+
+Program Simplifier::rewrite(Program&& program) {
+    zero_ = all_zero_ = true;
+    program.expressions(rewrite(program, program.expressions()));
+    return std::move(program);
+}
+
+ExpressionList Simplifier::rewrite(Program& program,
+                                   const ExpressionList& expressions) {
+    size_t start = pending_.size();
+
+    for (auto expression: expressions) {
+        if (auto inc = dynamic_cast<const Increment*>(expression)) {
+            add(program, inc, inc->offset(), inc->at());
             continue;
-        } else if (expressions->empty() ||
-                  typeid(*expressions->back()) != typeid(*next) ||
-                  !expressions->back()->repeatable()) {
-            expressions->push_back(std::move(next));
+        }
+        if (auto dec = dynamic_cast<const Decrement*>(expression)) {
+            add(program, dec, -dec->offset(), dec->at());
+            continue;
+        }
+        if (auto fwd = dynamic_cast<const Forward*>(expression)) {
+            move(program, fwd, fwd->offset());
+            continue;
+        }
+        if (auto bwd = dynamic_cast<const Backward*>(expression)) {
+            move(program, bwd, -bwd->offset());
+            continue;
+        }
+
+        // (dead nodes go before flushing, so the code around them
+        // can still be folded)
+        if (dead(expression)) {
+            remove(expression);
+            continue;
+        }
+
+        flush(program);
+
+        if (auto loop = dynamic_cast<Loop*>(expression)) {
+            // The body starts with a non-zero cell, and it's zero again
+            // when the loop ends:
+            zero_ = all_zero_ = false;
+            loop->children(rewrite(program, loop->children()));
+            zero_ = true;
+        } else if (dynamic_cast<const ScanLeft*>(expression) ||
+                   dynamic_cast<const ScanRight*>(expression)) {
+            zero_ = true;
+        } else if (auto zero = dynamic_cast<const SetZero*>(expression)) {
+            if (zero->at() == 0) zero_ = true;
+        } else if (auto muladd = dynamic_cast<const MulAdd*>(expression)) {
+            if (muladd->at() + muladd->offset() == 0) zero_ = false;
+        } else if (auto input = dynamic_cast<const Input*>(expression)) {
+            if (input->at() == 0) zero_ = false;
+            all_zero_ = false;
+        }
+
+        pending_.push_back(expression);
+    }
+
+    flush(program);
+
+    return program.list(pending_, start);
+}
+
+bool Simplifier::dead(const Expression* expression) const {
+    // (with the pending addition or move applied)
+    bool all_zero = all_zero_ && !(add_origin_ && add_ != 0);
+    bool zero = add_origin_ && add_ != 0 ? add_at_ != 0 && zero_ :
+                move_origin_ && move_ != 0 ? all_zero : zero_;
+
+    if (dynamic_cast<const Loop*>(expression) ||
+        dynamic_cast<const ScanLeft*>(expression) ||
+        dynamic_cast<const ScanRight*>(expression)) {
+        return zero;
+    }
+    if (auto clear = dynamic_cast<const SetZero*>(expression)) {
+        return all_zero || (clear->at() == 0 && zero);
+    }
+    if (auto muladd = dynamic_cast<const MulAdd*>(expression)) {
+        return all_zero || (muladd->at() == 0 && zero);
+    }
+    return false;
+}
+
+void Simplifier::add(Program& program, const Expression* origin,
+                     ssize_t value, ssize_t at) {
+    if (move_origin_ || (add_origin_ && at != add_at_)) flush(program);
+    if (add_origin_) {
+        ++removed_;
+    } else {
+        add_origin_ = origin;
+        add_at_ = at;
+    }
+    add_ += value;
+}
+
+void Simplifier::move(Program& program, const Expression* origin, ssize_t value) {
+    if (add_origin_) flush(program);
+    if (move_origin_) {
+        ++removed_;
+    } else {
+        move_origin_ = origin;
+    }
+    move_ += value;
+}
+
+// Emits the pending addition or move, if it isn't zero:
+void Simplifier::flush(Program& program) {
+    if (add_origin_) {
+        if (add_ > 0) {
+            pending_.push_back(program.make_from<Increment>(add_origin_, add_, add_at_));
+        } else if (add_ < 0) {
+            pending_.push_back(program.make_from<Decrement>(add_origin_, -add_, add_at_));
+        } else {
+            ++removed_;
+        }
+        if (add_ != 0) {
+            if (add_at_ == 0) zero_ = false;
+            all_zero_ = false;
+        }
+    }
+    if (move_origin_) {
+        if (move_ > 0) {
+            pending_.push_back(program.make_from<Forward>(move_origin_, move_));
+        } else if (move_ < 0) {
+            pending_.push_back(program.make_from<Backward>(move_origin_, -move_));
         } else {
-            expressions->back()->repeat();
+            ++removed_;
         }
+        // (the new cell is only known to be zero if all of them are)
+        if (move_ != 0) zero_ = all_zero_;
+    }
+    add_ = move_ = 0;
+    add_origin_ = move_origin_ = nullptr;
+}
+
+void Simplifier::remove(const Expression* expression) {
+    ++removed_;
+    if (auto loop = dynamic_cast<const Loop*>(expression)) {
+        for (auto child: loop->children()) remove(child);
+    }
+}
+
+// Replaces clear, scan and multiply loops with the equivalent
+// SetZero, ScanLeft/ScanRight and MulAdd nodes:
+class IdiomRecognizer
+{
+public:
+    IdiomRecognizer() = default;
+    ~IdiomRecognizer() = default;
+
+    Program rewrite(Program&&);
+
+private:
+    ExpressionVector pending_;
+
+    // Net change of each cell in the loop being rewritten, by offset
+    // (loop bodies are short, so a linear search is enough):
+    std::vector<std::pair<ssize_t, ssize_t>> deltas_;
+
+    ssize_t& delta(ssize_t offset) {
+        for (auto &delta: deltas_) {
+            if (delta.first == offset) return delta.second;
+        }
+        deltas_.emplace_back(offset, 0);
+        return deltas_.back().second;
+    }
+
+    ExpressionList rewrite(Program&, const ExpressionList&);
+    bool rewrite_loop(Program&, const Loop&);
+};
+
+Program IdiomRecognizer::rewrite(Program&& program) {
+    program.expressions(rewrite(program, program.expressions()));
+    return std::move(program);
+}
+
+ExpressionList IdiomRecognizer::rewrite(Program& program,
+                                        const ExpressionList& expressions) {
+    size_t start = pending_.size();
+
+    for (auto expression: expressions) {
+        auto loop = dynamic_cast<Loop*>(expression);
+
+        if (!loop) {
+            pending_.push_back(expression);
+            continue;
+        }
+
+        loop->children(rewrite(program, loop->children()));
+
+        if (!rewrite_loop(program, *loop)) {
+            pending_.push_back(expression);
+        }
+    }
+
+    return program.list(pending_, start);
+}
+
+bool IdiomRecognizer::rewrite_loop(Program& program, const Loop& loop) {
+    const ExpressionList& body = loop.children();
+
+    if (body.size() == 1) {
+        auto child = body.front();
+
+        if (auto fwd = dynamic_cast<const Forward*>(child)) {
+            pending_.push_back(program.make_from<ScanRight>(&loop, fwd->offset()));
+            return true;
+        }
+        if (auto bwd = dynamic_cast<const Backward*>(child)) {
+            pending_.push_back(program.make_from<ScanLeft>(&loop, bwd->offset()));
+            return true;
+        }
+    }
+
+    // Otherwise, it's a clear or multiply loop only if it just adds
+    // constants to cells around the current one, comes back to where
+    // it started, and changes the current cell by exactly -1 or +1.
+    // Since cells wrap around, a +1 loop runs -value times, so the
+    // factors are negated in that case:
+    deltas_.clear();
+    ssize_t position = 0;
+
+    for (auto expression: body) {
+        if (auto inc = dynamic_cast<const Increment*>(expression)) {
+            delta(position + inc->at()) += inc->offset();
+        } else if (auto dec = dynamic_cast<const Decrement*>(expression)) {
+            delta(position + dec->at()) -= dec->offset();
+        } else if (auto fwd = dynamic_cast<const Forward*>(expression)) {
+            position += fwd->offset();
+        } else if (auto bwd = dynamic_cast<const Backward*>(expression)) {
+            position -= bwd->offset();
+        } else {
+            return false;
+        }
+    }
+
+    if (position != 0) return false;
+
+    ssize_t step = delta(0);
+    if (step != -1 && step != 1) return false;
+
+    std::sort(deltas_.begin(), deltas_.end());
+
+    for (const auto &delta: deltas_) {
+        if (delta.first == 0 || delta.second == 0) continue;
+        pending_.push_back(
+            program.make_from<MulAdd>(&loop, delta.first, -step * delta.second)
+        );
+    }
+    pending_.push_back(program.make_from<SetZero>(&loop));
+
+    return true;
+}
+
+// Turns the pointer moves inside each basic block into offsets of the
+// operations that follow them, so '>+>+<<-' becomes Increment(1, 1),
+// Increment(1, 2), Decrement(1, 0). The net move of the block is only
+// applied before the next loop or scan (which need the actual pointer)
+// and at the end of the block:
+class OffsetFolder
+{
+public:
+    OffsetFolder() = default;
+    ~OffsetFolder() = default;
+
+    Program rewrite(Program&&);
+
+private:
+    ExpressionVector pending_;
+
+    ExpressionList rewrite(Program&, const ExpressionList&);
+    void move(Program&, ssize_t&, const Expression*);
+};
+
+Program OffsetFolder::rewrite(Program&& program) {
+    program.expressions(rewrite(program, program.expressions()));
+    return std::move(program);
+}
+
+ExpressionList OffsetFolder::rewrite(Program& program,
+                                     const ExpressionList& expressions) {
+    size_t start = pending_.size();
+    ssize_t position = 0;
+
+    // The last move folded in this list, where the net move comes from
+    // (a loop in between has its own):
+    const Expression* last_move = nullptr;
+
+    for (auto expression: expressions) {
+        if (auto fwd = dynamic_cast<const Forward*>(expression)) {
+            position += fwd->offset();
+            last_move = fwd;
+        } else if (auto bwd = dynamic_cast<const Backward*>(expression)) {
+            position -= bwd->offset();
+            last_move = bwd;
+        } else if (auto inc = dynamic_cast<const Increment*>(expression)) {
+            pending_.push_back(
+                program.make_from<Increment>(inc, inc->offset(), inc->at() + position)
+            );
+        } else if (auto dec = dynamic_cast<const Decrement*>(expression)) {
+            pending_.push_back(
+                program.make_from<Decrement>(dec, dec->offset(), dec->at() + position)
+            );
+        } else if (auto input = dynamic_cast<const Input*>(expression)) {
+            pending_.push_back(
+                program.make_from<Input>(input, input->at() + position)
+            );
+        } else if (auto output = dynamic_cast<const Output*>(expression)) {
+            pending_.push_back(
+                program.make_from<Output>(output, output->at() + position)
+            );
+        } else if (auto zero = dynamic_cast<const SetZero*>(expression)) {
+            pending_.push_back(
+                program.make_from<SetZero>(zero, zero->at() + position)
+            );
+        } else if (auto muladd = dynamic_cast<const MulAdd*>(expression)) {
+            pending_.push_back(
+                program.make_from<MulAdd>(muladd,
+                                          muladd->offset(),
+                                          muladd->factor(),
+                                          muladd->at() + position)
+            );
+        } else {
+            if (auto loop = dynamic_cast<Loop*>(expression)) {
+                loop->children(rewrite(program, loop->children()));
+            }
+            move(program, position, last_move);
+            pending_.push_back(expression);
+        }
+    }
+
+    move(program, position, last_move);
+
+    return program.list(pending_, start);
+}
+
+void OffsetFolder::move(Program& program, ssize_t& position, const Expression* origin) {
+    if (position > 0) {
+        pending_.push_back(program.make_from<Forward>(origin, position));
+    } else if (position < 0) {
+        pending_.push_back(program.make_from<Backward>(origin, -position));
+    }
+    position = 0;
+}
+
+// Every cell starts at zero, so a program does the same thing every
+// time until it reads its first input. This runs that part of it at
+// compile time, up to the first Input or 'budget' nodes (loop tests
+// and cells crossed by scans count too), and leaves the state it got
+// to in prefix(). The program is replaced with what's left to run: if
+// it stopped inside a loop, that's the rest of the loop body, the
+// loop itself again, and the rest of each enclosing list. Operations
+// that would go left of the first cell, or too far right, stop it as
+// well, so the runners get to handle them as they normally would.
+class PartialEvaluator : public ExpressionVisitor
+{
+public:
+    static const size_t DefaultBudget = 1 << 20;
+
+    PartialEvaluator(size_t cell, size_t budget = DefaultBudget)
+     : mask_(cell == 1 ? 0xff : cell == 2 ? 0xffff : 0xffffffff),
+       budget_(budget) {}
+    ~PartialEvaluator() = default;
+
+    Program rewrite(Program&&);
+
+    const Prefix& prefix() const {return prefix_;}
+
+    virtual void visit(const Increment& inc) {
+        if (run(inc.at())) cell(inc.at()) += inc.offset();
+    }
+
+    virtual void visit(const Decrement& dec) {
+        if (run(dec.at())) cell(dec.at()) -= dec.offset();
+    }
+
+    virtual void visit(const Forward& fwd)   {if (run(fwd.offset())) position_ += fwd.offset();}
+    virtual void visit(const Backward& bwd)  {if (run(-bwd.offset())) position_ -= bwd.offset();}
+    virtual void visit(const Input&)         {ok_ = false;}
+    virtual void visit(const SetZero& zero)  {if (run(zero.at())) cell(zero.at()) = 0;}
+
+    virtual void visit(const Output& output) {
+        if (run(output.at())) prefix_.output += char(cell(output.at()));
+    }
+
+    virtual void visit(const Loop& loop) {
+        while (run(0) && cell(0)) {
+            if (!evaluate(loop.children())) return;
+        }
+    }
+
+    virtual void visit(const ScanLeft& scan)  {this->scan(-scan.stride());}
+    virtual void visit(const ScanRight& scan) {this->scan(scan.stride());}
+
+    virtual void visit(const MulAdd& muladd) {
+        if (run(muladd.at()) && run(muladd.at() + muladd.offset(), false)) {
+            cell(muladd.at() + muladd.offset()) +=
+                cell(muladd.at()) * uint32_t(muladd.factor());
+        }
+    }
+
+private:
+    // The evaluator stops before cells past this:
+    static const size_t MaxCells = 1 << 20;
+
+    ExpressionVector pending_;
+    Prefix prefix_;
+    uint32_t mask_;
+    size_t budget_;
+    ssize_t position_ = 0;
+    bool ok_ = true;
+
+    // Checks that the node about to run fits in the budget, and that
+    // the cell at 'at' can be touched, growing the tape if needed.
+    // Otherwise the node isn't run, and the evaluation is over:
+    bool run(ssize_t at, bool step = true) {
+        ssize_t index = position_ + at;
+        if (prefix_.steps == budget_ || index < 0 || size_t(index) >= MaxCells) {
+            ok_ = false;
+            return false;
+        }
+        if (size_t(index) >= prefix_.cells.size()) {
+            prefix_.cells.resize(index + 1);
+        }
+        if (step) ++prefix_.steps;
+        return true;
+    }
+
+    // (the values are masked when read, so they wrap as the cells do)
+    struct Cell {
+        uint32_t& value;
+        uint32_t mask;
+        operator uint32_t() const {return value & mask;}
+        Cell& operator+=(uint32_t x) {value = (value + x) & mask; return *this;}
+        Cell& operator-=(uint32_t x) {value = (value - x) & mask; return *this;}
+        Cell& operator=(uint32_t x) {value = x & mask; return *this;}
+    };
+
+    Cell cell(ssize_t at) {return Cell{prefix_.cells[position_ + at], mask_};}
+
+    void scan(ssize_t stride) {
+        ssize_t start = position_;
+        while (run(0) && cell(0)) {
+            position_ += stride;
+        }
+        if (!ok_) position_ = start;
+    }
+
+    // Runs 'expressions' until the evaluation stops, and then leaves
+    // what's left of them in pending_ (after what's left of the loop
+    // that stopped it, if any):
+    bool evaluate(const ExpressionList& expressions) {
+        for (auto it = expressions.begin(); it != expressions.end(); ++it) {
+            (*it)->accept(*this);
+            if (!ok_) {
+                pending_.insert(pending_.end(), it, expressions.end());
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+Program PartialEvaluator::rewrite(Program&& program) {
+    if (budget_ == 0) return std::move(program);
+
+    prefix_.complete = evaluate(program.expressions());
+    prefix_.position = position_;
+
+    // (the tape only needs the cells up to the last non-zero one)
+    while (!prefix_.cells.empty() && !prefix_.cells.back()) {
+        prefix_.cells.pop_back();
     }
 
-    if (!stack.empty()) throw ExcessiveOpeningBrackets();
+    program.expressions(program.list(pending_, 0));
+    return std::move(program);
+}
 
-    return std::move(*expressions);
-}
\ No newline at end of file
+#endif
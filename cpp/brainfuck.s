@@ -1,36 +1,49 @@
 increment:
-  movq    $1, %rax
-  addl    %eax, (%rdi)
+  addl    $value, offset4(%rdi)   # cell at 'offset' += value
 
 decrement:
-  movq    $1, %rax
-  subl    %eax, (%rdi)
+  subl    $value, offset4(%rdi)   # cell at 'offset' -= value
 
 forward:
-  movq    $1, %rax
-  addq    %rax, %rdi
+  addq    $value4, %rdi     # value * 4
 
 backward:
-  movq    $1, %rax
-  subq    %rax, %rdi
+  subq    $value4, %rdi     # value * 4
 
 read:
-  pushq   %rdi
-  movq    $0x02000003, %rax # SYS_read
-  movq    %rdi, %rsi # buf
-  movq    $0, %rdi # stdin
-  movq    $1, %rdx # buf_len
-  syscall
-  popq    %rdi
+  callq   read_byte         # next input byte in %eax
+  movl    %eax, offset4(%rdi)
+
+read_unchanged:             # with --eof=unchanged
+  callq   read_byte
+  jc      1f                # CF: EOF, keep the cell
+  movl    %eax, offset4(%rdi)
+1:
 
 write:
-  pushq   %rdi              # save RDI
-  movq    $0x02000004, %rax # SYS_write
-  movq    %rdi, %rsi        # set RDI as the 'buf'
-  movq    $1, %rdi          # fd: stdout
-  movq    $1, %rdx          # len: 1
-  syscall                   # execute the call
-  popq    %rdi              # restore RDI
+  movq    (%rbx), %rax      # out_len
+  movb    offset4(%rdi), %cl # (only the low byte of the cell)
+  movb    %cl, 32(%rbx,%rax) # out[out_len] = cell
+  incq    %rax
+  movq    %rax, (%rbx)
+  cmpq    $65536, %rax      # buffer full?
+  jne     1f
+  callq   flush
+1:
+
+write_newline:              # with --flush=newline
+  movq    (%rbx), %rax
+  movb    offset4(%rdi), %cl
+  movb    %cl, 32(%rbx,%rax)
+  incq    %rax
+  movq    %rax, (%rbx)
+  cmpq    $65536, %rax
+  je      1f                # full, or
+  cmpb    $10, %cl          # newline?
+  jne     2f
+1:
+  callq   flush
+2:
 
 loop_start:
   cmpl    $0, (%rdi)
@@ -40,8 +53,285 @@ loop_end:
   cmpl    $0, (%rdi)
   jne     0
 
+loop_rotated:               # without --no-rotate
+  jmp     25f
+  .p2align 4                # innermost loops only, never run
+24:
+  # (body)
+25:
+  cmpl    $0, (%rdi)
+  jne     24b
+
 break:
   int     $3
 
+prologue:
+  pushq   %rbx              # save RBX
+  movq    %rsi, %rbx        # RBX: I/O context
+  jmp     body              # skip the subroutines
+
+flush:
+  leaq    32(%rbx), %rsi    # buf: out
+  movq    (%rbx), %rdx      # len: out_len
+  movq    $0, (%rbx)        # out_len = 0
+write_out:                  # writes %rdx bytes from %rsi
+  pushq   %rdi              # save RDI
+2:
+  testq   %rdx, %rdx
+  jle     3f
+  movl    $0x02000004, %eax # SYS_write (1 on Linux)
+  movl    28(%rbx), %edi    # fd: out_fd (stdout)
+  syscall
+  testq   %rax, %rax
+  jle     3f
+  addq    %rax, %rsi        # short write, retry
+  subq    %rax, %rdx
+  jmp     2b
+3:
+  popq    %rdi              # restore RDI
+  retq
+
+read_byte:
+  movq    8(%rbx), %rax     # in_pos
+  cmpq    16(%rbx), %rax    # in_len
+  jb      4f
+  callq   flush             # flush before blocking (unless --flush=exit)
+  pushq   %rdi
+  movl    $0x02000003, %eax # SYS_read (0 on Linux)
+  movl    24(%rbx), %edi    # fd: in_fd (stdin)
+  leaq    65568(%rbx), %rsi # buf: in
+  movl    $65536, %edx      # buf_len
+  syscall
+  popq    %rdi
+  testq   %rax, %rax
+  jle     5f
+  movq    %rax, 16(%rbx)    # in_len = read bytes
+  xorl    %eax, %eax        # in_pos = 0
+4:
+  movzbl  65568(%rbx,%rax), %ecx
+  incq    %rax
+  movq    %rax, 8(%rbx)
+  movl    %ecx, %eax
+  clc
+  retq
+5:
+  addq    $8, %rsp          # EOF: drop the return address
+  callq   flush             # and leave the program
+  xorl    %eax, %eax        # (returning NULL)
+  popq    %rbx
+  retq
+
+read_byte_eof:              # EOF with --eof=0|-1|unchanged
+  movl    $value, %eax      # 0 or -1
+  stc                       # (CF tells EOF apart)
+  retq
+
+prefix:                     # the state left by the PartialEvaluator
+  jmp     26f
+27:
+  .ascii  "Hello World!\n"   # its output
+26:
+  leaq    27b(%rip), %rsi
+  movq    $13, %rdx
+  callq   write_out
+  movl    $87, 4(%rdi)      # the non-zero cells
+  addq    $16, %rdi         # and the position
+
 finish:
+  callq   flush             # (not when compiling a single loop)
+  movq    %rdi, %rax        # return the pointer
+  popq    %rbx
   retq
+
+set_zero:
+  movl    $0, offset4(%rdi)
+
+scan_left:
+  cmpl    $0, (%rdi)
+  je      7f
+6:
+  subq    $stride4, %rdi    # stride * 4
+  cmpl    $0, (%rdi)
+  jne     6b
+7:
+
+scan_right:
+  cmpl    $0, (%rdi)
+  je      9f
+8:
+  addq    $stride4, %rdi    # stride * 4
+  cmpl    $0, (%rdi)
+  jne     8b
+9:
+
+mul_add:
+  movl    at4(%rdi), %eax
+  imull   $factor, %eax, %eax
+  addl    %eax, offset4(%rdi) # (at + offset) * 4
+
+mul_add_cached:             # the source stays in %edx
+  movl    (%rdi), %edx
+  imull   $2, %edx, %eax
+  addl    %eax, 4(%rdi)
+  imull   $3, %edx, %eax
+  addl    %eax, 8(%rdi)
+  xorl    %edx, %edx        # set_zero of the source
+  movl    %edx, (%rdi)      # written back before moves, I/O and tests
+
+scan_right_sse2:
+  cmpl     $0, (%rdi)
+  je       11f
+  pxor     %xmm1, %xmm1
+10:
+  movdqu   (%rdi), %xmm0     # 4 cells at once
+  pcmpeqd  %xmm1, %xmm0
+  pmovmskb %xmm0, %eax
+  andl     $mask, %eax       # lanes at multiples of the stride
+  jnz      12f
+  addq     $step4, %rdi
+  jmp      10b
+12:
+  bsfl     %eax, %eax        # first zero lane (in bytes)
+  addq     %rax, %rdi
+11:
+
+scan_left_sse2:
+  cmpl     $0, (%rdi)
+  je       14f
+  pxor     %xmm1, %xmm1
+13:
+  movdqu   -12(%rdi), %xmm0  # 4 cells at once, ending at (%rdi)
+  pcmpeqd  %xmm1, %xmm0
+  pmovmskb %xmm0, %eax
+  andl     $mask, %eax
+  jnz      15f
+  subq     $step4, %rdi
+  jmp      13b
+15:
+  bsrl     %eax, %eax        # last zero lane (its last byte)
+  leaq     -15(%rdi,%rax), %rdi
+14:
+
+scan_right_avx2:
+  cmpl     $0, (%rdi)
+  je       17f
+  vpxor    %ymm1, %ymm1, %ymm1
+16:
+  vmovdqu  (%rdi), %ymm0     # 8 cells at once
+  vpcmpeqd %ymm1, %ymm0, %ymm0
+  vpmovmskb %ymm0, %eax
+  andl     $mask, %eax
+  jnz      18f
+  addq     $step4, %rdi
+  jmp      16b
+18:
+  vzeroupper
+  bsfl     %eax, %eax
+  addq     %rax, %rdi
+17:
+
+scan_left_avx2:
+  cmpl     $0, (%rdi)
+  je       20f
+  vpxor    %ymm1, %ymm1, %ymm1
+19:
+  vmovdqu  -28(%rdi), %ymm0
+  vpcmpeqd %ymm1, %ymm0, %ymm0
+  vpmovmskb %ymm0, %eax
+  andl     $mask, %eax
+  jnz      21f
+  subq     $step4, %rdi
+  jmp      19b
+21:
+  vzeroupper
+  bsrl     %eax, %eax
+  leaq     -31(%rdi,%rax), %rdi
+20:
+
+# Entry point of the executables written by --emit-elf (Linux only),
+# placed after finish(): it maps the tape (guards included), calls the
+# program with the I/O context, which lives in the zeroed .bss, and
+# exits with the status of the whole thing:
+elf_entry:
+  movl     $9, %eax          # SYS_mmap
+  xorl     %edi, %edi
+  movl     $size, %esi       # guards + reserve
+  xorl     %edx, %edx        # PROT_NONE
+  movl     $0x4022, %r10d    # MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE
+  movq     $-1, %r8
+  xorl     %r9d, %r9d
+  syscall
+  testq    %rax, %rax
+  js       22f
+  leaq     guard(%rax), %rdi # past the left guard
+  movl     $reserve, %esi
+  movl     $3, %edx          # PROT_READ|PROT_WRITE
+  movl     $10, %eax         # SYS_mprotect
+  syscall
+  testq    %rax, %rax
+  jnz      22f
+  addq     $padding, %rdi    # first cell
+  leaq     context(%rip), %rsi
+  movl     $1, 28(%rsi)      # out_fd: stdout (in_fd is 0)
+  callq    prologue
+  xorl     %edi, %edi
+  jmp      23f
+22:
+  movl     $1, %edi
+23:
+  movl     $231, %eax        # SYS_exit_group
+  syscall
+
+# With 8-bit and 16-bit cells the instructions that touch the tape
+# use the byte and word forms (with the offsets scaled by 1 and 2),
+# and the vector scans compare bytes or words:
+
+increment_byte:
+  addb    $value, offset(%rdi)
+
+increment_word:
+  addw    $value, offset2(%rdi)
+
+decrement_byte:
+  subb    $value, offset(%rdi)
+
+decrement_word:
+  subw    $value, offset2(%rdi)
+
+read_cell_byte:
+  movb    %al, offset(%rdi)
+
+read_cell_word:
+  movw    %ax, offset2(%rdi)
+
+loop_start_byte:
+  cmpb    $0, (%rdi)
+
+loop_start_word:
+  cmpw    $0, (%rdi)
+
+set_zero_byte:
+  movb    $0, offset(%rdi)
+
+set_zero_word:
+  movw    $0, offset2(%rdi)
+
+mul_add_byte:
+  movzbl  at(%rdi), %eax
+  imull   $factor, %eax, %eax
+  addb    %al, offset(%rdi)
+
+mul_add_word:
+  movzwl  at2(%rdi), %eax
+  imull   $factor, %eax, %eax
+  addw    %ax, offset2(%rdi)
+
+scan_compare_byte:
+  pcmpeqb  %xmm1, %xmm0      # 16 cells at once
+  vpcmpeqb %ymm1, %ymm0, %ymm0 # 32 cells at once
+
+scan_compare_word:
+  pcmpeqw  %xmm1, %xmm0      # 8 cells at once
+  vpcmpeqw %ymm1, %ymm0, %ymm0 # 16 cells at once
+
+body:
@@ -0,0 +1,327 @@
+#ifndef BRAINFUCK_CACHE_H
+#define BRAINFUCK_CACHE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 64-bit FNV-1a, to name and check the cache entries (not meant to
+// resist anyone crafting collisions, the entries are fully compared):
+inline uint64_t fnv1a(const void* data, size_t size,
+                      uint64_t hash = 0xcbf29ce484222325) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Generated code read back from the cache, mapped read/exec straight
+// from the file (so it's never writable). The mapping is released
+// with the object:
+class CachedCode
+{
+private:
+    uint8_t* data_;
+    size_t size_;
+    size_t code_offset_;
+
+public:
+    CachedCode() : data_(nullptr), size_(0), code_offset_(0) {}
+    CachedCode(uint8_t* data, size_t size, size_t code_offset)
+     : data_(data), size_(size), code_offset_(code_offset) {}
+
+    ~CachedCode() {
+        if (data_) munmap(data_, size_);
+    }
+
+    CachedCode(CachedCode&& other)
+     : data_(other.data_), size_(other.size_), code_offset_(other.code_offset_) {
+        other.data_ = nullptr;
+    }
+
+    CachedCode(const CachedCode&) = delete;
+    CachedCode& operator=(const CachedCode&) = delete;
+
+    explicit operator bool() const {return data_ != nullptr;}
+
+    const uint8_t* code() const {return data_ + code_offset_;}
+};
+
+// A directory of compiled programs, so that running the same program
+// again skips parsing and compiling it. Entries are keyed by the
+// source and by the options it was compiled with (which include the
+// Version below, so a JIT that generates different code never runs
+// the code of an older one). Each entry is a file with a header, the code, and a
+// copy of the options and the source, which are compared on lookup,
+// so a hash collision or a corrupted file is just a miss:
+//
+//   | header | code ... | options | source ... |
+//
+// Entries are written to a temporary file and renamed into place, so
+// concurrent processes see either the whole entry or none, and the
+// least recently used ones are removed when the directory grows
+// past its limit (along with the temporary files of writers that
+// died before renaming them).
+class CodeCache
+{
+public:
+    // Bumped with every change to the code the JIT generates for the
+    // same source and options:
+    static const int Version = 1;
+
+    static const size_t DefaultMaxSize = 64 << 20;
+    // (temporary files older than this were left by a crashed writer)
+    static const time_t StaleAge = 60 * 60;
+
+    CodeCache(std::string dir, size_t max_size = DefaultMaxSize)
+     : dir_(std::move(dir)), max_size_(max_size) {}
+
+    // $BRAINFUCK_CACHE, $XDG_CACHE_HOME/brainfuck-jit or
+    // ~/.cache/brainfuck-jit, in that order:
+    static std::string default_dir() {
+        if (const char* dir = getenv("BRAINFUCK_CACHE")) {
+            return dir;
+        }
+        if (const char* dir = getenv("XDG_CACHE_HOME")) {
+            return std::string(dir) + "/brainfuck-jit";
+        }
+        if (const char* home = getenv("HOME")) {
+            return std::string(home) + "/.cache/brainfuck-jit";
+        }
+        return "";
+    }
+
+    CachedCode lookup(std::string_view source, const std::string& options) const {
+        if (dir_.empty()) return CachedCode();
+
+        std::string path = entry_path(source, options);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return CachedCode();
+
+        uint8_t* data = nullptr;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+            void* mapped = mmap(0, st.st_size, PROT_READ | PROT_EXEC,
+                                MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                if (valid((const uint8_t*) mapped, st.st_size, source, options)) {
+                    data = (uint8_t*) mapped;
+                    // The modification time tells how recently it was
+                    // used, for the eviction:
+                    futimens(fd, nullptr);
+                } else {
+                    munmap(mapped, st.st_size);
+                }
+            }
+        }
+
+        close(fd);
+        if (!data) return CachedCode();
+        return CachedCode(data, st.st_size, sizeof(Header));
+    }
+
+    // Returns false if the entry couldn't be written (the cache is
+    // just an optimization, so the caller can ignore it):
+    bool store(std::string_view source, const std::string& options,
+               const uint8_t* code, size_t size) const {
+        if (dir_.empty() || !make_dirs(dir_)) return false;
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, Magic, sizeof(header.magic));
+        header.code_size = size;
+        header.options_size = options.size();
+        header.source_size = source.size();
+        header.checksum = fnv1a(code, size);
+
+        std::string path = entry_path(source, options);
+        std::string temp = path + ".tmp." + std::to_string(getpid());
+
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) return false;
+
+        bool written =
+            write_all(fd, &header, sizeof(header)) &&
+            write_all(fd, code, size) &&
+            write_all(fd, options.data(), options.size()) &&
+            write_all(fd, source.data(), source.size());
+
+        if (close(fd) != 0 || !written || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+
+        evict();
+        return true;
+    }
+
+    static bool make_dirs(const std::string& dir) {
+        for (size_t i = 1; i <= dir.size(); ++i) {
+            if (i == dir.size() || dir[i] == '/') {
+                std::string parent = dir.substr(0, i);
+                if (mkdir(parent.c_str(), 0755) == -1 && errno != EEXIST) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Removes the least recently used entries (the JIT's and the shared
+    // objects of the C backend, see cc.h) until the directory is back
+    // under its limit. The files with the same name but the suffix
+    // (the .c and the .so of the C backend) are one entry, removed
+    // together. Other processes may be doing the same, so entries that
+    // are already gone are just skipped (and the ones removed while
+    // mapped stay valid until unmapped):
+    void evict() const {
+        struct Entry {
+            std::vector<std::string> paths;
+            size_t size = 0;
+            time_t used = 0;
+        };
+
+        DIR* dir = opendir(dir_.c_str());
+        if (!dir) return;
+
+        std::unordered_map<std::string, Entry> entries;
+        size_t total = 0;
+        time_t now = time(nullptr);
+
+        while (struct dirent* ent = readdir(dir)) {
+            std::string name(ent->d_name), key;
+            bool temp = temporary(name);
+            if (!temp && !entry(name, key)) continue;
+
+            std::string path = dir_ + "/" + name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) continue;
+
+            if (temp) {
+                if (now - st.st_mtime > StaleAge) unlink(path.c_str());
+                continue;
+            }
+
+            Entry& entry = entries[key];
+            entry.paths.push_back(path);
+            entry.size += st.st_size;
+            entry.used = std::max(entry.used, st.st_mtime);
+            total += st.st_size;
+        }
+        closedir(dir);
+
+        if (total <= max_size_) return;
+
+        std::vector<const Entry*> order;
+        for (auto &entry: entries) order.push_back(&entry.second);
+        std::sort(order.begin(), order.end(),
+                  [](const Entry* a, const Entry* b) {return a->used < b->used;});
+
+        for (auto entry: order) {
+            if (total <= max_size_) break;
+            for (auto &path: entry->paths) unlink(path.c_str());
+            total -= entry->size;
+        }
+    }
+
+private:
+    static constexpr const char* Magic = "BFJITC01";
+
+    struct Header {
+        char magic[8];
+        uint64_t code_size;
+        uint64_t options_size;
+        uint64_t source_size;
+        uint64_t checksum;      // of the code
+        uint8_t reserved[24];
+    };
+
+    static_assert(sizeof(Header) == 64, "layout");
+
+    std::string dir_;
+    size_t max_size_;
+
+    std::string entry_path(std::string_view source, const std::string& options) const {
+        uint64_t hash = fnv1a(source.data(), source.size(),
+                              fnv1a(options.data(), options.size()));
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bfc", (unsigned long long) hash);
+        return dir_ + name;
+    }
+
+    static bool valid(const uint8_t* data, size_t size,
+                      std::string_view source, const std::string& options) {
+        Header header;
+        memcpy(&header, data, sizeof(header));
+
+        if (memcmp(header.magic, Magic, sizeof(header.magic)) != 0 ||
+            header.options_size != options.size() ||
+            header.source_size != source.size()) {
+            return false;
+        }
+
+        // (one field at a time, so that huge sizes in a damaged header
+        // can't wrap the sum around)
+        size_t left = size - sizeof(Header);
+        if (header.code_size > left) return false;
+        left -= header.code_size;
+        if (header.options_size > left) return false;
+        left -= header.options_size;
+        if (header.source_size != left) return false;
+
+        const uint8_t* code = data + sizeof(Header);
+        const uint8_t* stored_options = code + header.code_size;
+        const uint8_t* stored_source = stored_options + header.options_size;
+
+        return fnv1a(code, header.code_size) == header.checksum &&
+               memcmp(stored_options, options.data(), options.size()) == 0 &&
+               memcmp(stored_source, source.data(), source.size()) == 0;
+    }
+
+    // The files in the cache are named '<hash><suffix>', and 'key' is
+    // the hash:
+    static bool entry(const std::string& name, std::string& key) {
+        for (const char* suffix: {".bfc", ".so", ".c"}) {
+            size_t size = strlen(suffix);
+            if (name.size() > size && name.compare(name.size() - size, size, suffix) == 0) {
+                key = name.substr(0, name.size() - size);
+                return key.find('.') == std::string::npos;
+            }
+        }
+        return false;
+    }
+
+    // (being written, see store() and NativeBackend::compile())
+    static bool temporary(const std::string& name) {
+        return name.find(".tmp.") != std::string::npos;
+    }
+
+    static bool write_all(int fd, const void* data, size_t size) {
+        const uint8_t* ptr = (const uint8_t*) data;
+        while (size > 0) {
+            ssize_t written = write(fd, ptr, size);
+            if (written <= 0) return false;
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef BRAINFUCK_CC_H
+#define BRAINFUCK_CC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "brainfuck.h"
+#include "cache.h"
+#include "io.h"
+#include "jit.h"
+
+extern char **environ;
+
+// Another backend for the JIT: the optimized program is translated to
+// C, built by the system's C compiler as a shared object, and loaded
+// in the process. Building takes way longer than the JIT (tenths of a
+// second instead of microseconds), but an optimizing compiler makes
+// better code of the loops, so it pays off for the programs that run
+// the longest (and the shared objects are cached).
+//
+// The code has the same signature as the JIT's (see JITProgram::Code),
+// so it runs the same way, on the same tape and I/O buffers: the C
+// source declares IOBuffers, and the I/O policies are compiled in.
+class CEmitter : public ExpressionVisitor
+{
+private:
+    std::string code_;
+    size_t cell_;
+    IOPolicy io_;
+    int depth_ = 1;
+
+    void line(const std::string& text) {
+        code_.append(4 * depth_, ' ');
+        code_ += text;
+        code_ += '\n';
+    }
+
+    // The cell 'at' cells away from the current one:
+    static std::string cell(ssize_t at) {
+        return "p[" + std::to_string(at) + "]";
+    }
+
+    // Immediates, as cells wrap around:
+    static std::string value(ssize_t value) {
+        return std::to_string(uint32_t(value)) + "u";
+    }
+
+public:
+    CEmitter(size_t cell = 4, IOPolicy io = IOPolicy()) : cell_(cell), io_(io) {}
+
+    virtual void visit(const Increment& inc) {line(cell(inc.at()) + " += " + value(inc.offset()) + ";");}
+    virtual void visit(const Decrement& dec) {line(cell(dec.at()) + " -= " + value(dec.offset()) + ";");}
+    virtual void visit(const Forward& fwd)   {line("p += " + std::to_string(fwd.offset()) + ";");}
+    virtual void visit(const Backward& bwd)  {line("p -= " + std::to_string(bwd.offset()) + ";");}
+
+    virtual void visit(const Input& input) {
+        switch (io_.eof) {
+            case EOFPolicy::Exit:
+                line("if (!bf_read(io, &c)) goto eof;");
+                line(cell(input.at()) + " = c;");
+                break;
+            case EOFPolicy::Zero:
+                line(cell(input.at()) + " = bf_read(io, &c) ? c : 0;");
+                break;
+            case EOFPolicy::MinusOne:
+                line(cell(input.at()) + " = bf_read(io, &c) ? c : (cell) -1;");
+                break;
+            case EOFPolicy::Unchanged:
+                line("if (bf_read(io, &c)) " + cell(input.at()) + " = c;");
+                break;
+        }
+    }
+
+    virtual void visit(const Output& output) {line("bf_write(io, " + cell(output.at()) + ");");}
+
+    virtual void visit(const Loop& loop) {
+        line("while (p[0]) {");
+        ++depth_;
+        for (const auto &child: loop.children()) {
+            child->accept(*this);
+        }
+        --depth_;
+        line("}");
+    }
+
+    virtual void visit(const SetZero& zero) {line(cell(zero.at()) + " = 0;");}
+
+    virtual void visit(const ScanLeft& scan) {
+        line("while (p[0]) p -= " + std::to_string(scan.stride()) + ";");
+    }
+
+    virtual void visit(const ScanRight& scan) {
+        line("while (p[0]) p += " + std::to_string(scan.stride()) + ";");
+    }
+
+    virtual void visit(const MulAdd& muladd) {
+        // (as unsigned ints, see Memory::muladd)
+        line(cell(muladd.at() + muladd.offset()) + " += (uint32_t) " +
+             cell(muladd.at()) + " * " + value(muladd.factor()) + ";");
+    }
+
+    // The whole translation unit, with bf_main() the entry point. With
+    // a Prefix, it starts by writing its output and the cells it left
+    // (as JITCompiler::compile() does):
+    std::string emit(const ExpressionList& expressions, const Prefix& prefix = Prefix()) {
+        const char* types[] = {"", "uint8_t", "uint16_t", "", "uint32_t"};
+
+        code_ =
+            "#include <errno.h>\n"
+            "#include <stddef.h>\n"
+            "#include <stdint.h>\n"
+            "#include <unistd.h>\n"
+            "\n"
+            "typedef " + std::string(types[cell_]) + " cell;\n"
+            "\n"
+            "/* (see IOBuffers in io.h) */\n"
+            "struct io {\n"
+            "    uint64_t out_len, in_pos, in_len;\n"
+            "    int32_t in_fd, out_fd;\n"
+            "    uint8_t out[" + std::to_string(IOBuffers::BufferSize) + "];\n"
+            "    uint8_t in[" + std::to_string(IOBuffers::BufferSize) + "];\n"
+            "};\n"
+            "\n"
+            "static void bf_write_all(int fd, const uint8_t* data, size_t size) {\n"
+            "    while (size > 0) {\n"
+            "        ssize_t written = write(fd, data, size);\n"
+            "        if (written == -1 && errno == EINTR) continue;\n"
+            "        if (written <= 0) break;\n"
+            "        data += written;\n"
+            "        size -= written;\n"
+            "    }\n"
+            "}\n"
+            "\n"
+            "static void bf_flush(struct io* io) {\n"
+            "    bf_write_all(io->out_fd, io->out, io->out_len);\n"
+            "    io->out_len = 0;\n"
+            "}\n"
+            "\n"
+            "static inline void bf_write(struct io* io, uint8_t c) {\n"
+            "    io->out[io->out_len++] = c;\n"
+            "    if (io->out_len == sizeof(io->out)" +
+            (io_.flush == FlushPolicy::Newline ? " || c == '\\n'" : "") + ") bf_flush(io);\n"
+            "}\n"
+            "\n"
+            "/* Returns 0 once the input is over */\n"
+            "static inline int bf_read(struct io* io, int* c) {\n"
+            "    if (io->in_pos == io->in_len) {\n" +
+            (io_.flush != FlushPolicy::Exit ? "        bf_flush(io);\n" : "") +
+            "        ssize_t count;\n"
+            "        do {\n"
+            "            count = read(io->in_fd, io->in, sizeof(io->in));\n"
+            "        } while (count == -1 && errno == EINTR);\n"
+            "        if (count <= 0) return 0;\n"
+            "        io->in_pos = 0;\n"
+            "        io->in_len = count;\n"
+            "    }\n"
+            "    *c = io->in[io->in_pos++];\n"
+            "    return 1;\n"
+            "}\n"
+            "\n"
+            "uint8_t* bf_main(uint8_t* memory, struct io* io) {\n"
+            "    cell* p = (cell*) memory;\n"
+            "    int c;\n"
+            "    (void) c;\n";
+
+        if (!prefix.output.empty()) {
+            std::string data;
+            for (unsigned char c: prefix.output) {
+                data += std::to_string(c) + ",";
+            }
+            line("static const uint8_t output[] = {" + data + "};");
+            line("bf_write_all(io->out_fd, output, sizeof(output));");
+        }
+        if (!prefix.complete) {
+            for (size_t i = 0; i < prefix.cells.size(); ++i) {
+                if (prefix.cells[i]) line(cell(i) + " = " + value(prefix.cells[i]) + ";");
+            }
+            if (prefix.position) {
+                line("p += " + std::to_string(prefix.position) + ";");
+            }
+        }
+
+        for (const auto &expression: expressions) {
+            expression->accept(*this);
+        }
+
+        line("bf_flush(io);");
+        line("return (uint8_t*) p;");
+        if (io_.eof == EOFPolicy::Exit) {
+            code_ += "eof:\n";
+            line("bf_flush(io);");
+            line("return NULL;");
+        }
+        code_ += "}\n";
+
+        return std::move(code_);
+    }
+};
+
+class CompilerFailed: public std::exception {
+    virtual const char* what() const throw() {
+        return "The C compiler failed";
+    }
+};
+
+// A shared object loaded by NativeBackend, unloaded with the object:
+class NativeCode
+{
+private:
+    void* handle_;
+    JITProgram::Code code_;
+
+public:
+    NativeCode(void* handle)
+     : handle_(handle), code_((JITProgram::Code) dlsym(handle, "bf_main")) {}
+
+    ~NativeCode() {dlclose(handle_);}
+
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    JITProgram::Code code() const {return code_;}
+};
+
+// Builds the C source of a CEmitter with $CC (or cc), and keeps the
+// shared objects in the same directory as the CodeCache, named after
+// the hash of the source (and of the command that builds it), with a
+// copy of the source to compare with on lookup, which is all of the
+// key:
+//
+//   0123456789abcdef.c, 0123456789abcdef.so
+//
+// They're evicted along with the JIT's entries, the two files of an
+// entry together. Without a directory,
+// they're built in a temporary one and removed once loaded.
+class NativeBackend
+{
+private:
+    std::string dir_;
+    size_t max_size_;
+    std::string compiler_;
+
+    std::vector<std::string> command(const std::string& source_path,
+                                     const std::string& object_path) const {
+        return {compiler_, "-O2", "-shared", "-fPIC", "-o", object_path, source_path};
+    }
+
+    std::string key(const std::string& source) const {
+        std::string text;
+        for (auto &arg: command("", "")) text += arg + " ";
+        return "/* " + text + "*/\n" + source;
+    }
+
+    static bool read_file(const std::string& path, std::string& contents) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        char buffer[1 << 16];
+        ssize_t count;
+        contents.clear();
+        while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+            contents.append(buffer, count);
+        }
+        close(fd);
+        return count == 0;
+    }
+
+    static bool write_file(const std::string& path, const std::string& contents) {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        return fclose(file) == 0 && written;
+    }
+
+    bool build(const std::string& source_path, const std::string& object_path) const {
+        std::vector<std::string> args = command(source_path, object_path);
+        std::vector<char*> argv;
+        for (auto &arg: args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int status;
+        return posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) == 0 &&
+               waitpid(pid, &status, 0) == pid &&
+               WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    // (quietly for the ones in the cache, which may have been evicted
+    // or damaged: that's just a miss)
+    static std::unique_ptr<NativeCode> load(const std::string& object_path, bool quiet = false) {
+        void* handle = dlopen(object_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            if (!quiet) fprintf(stderr, "%s\n", dlerror());
+            return nullptr;
+        }
+        std::unique_ptr<NativeCode> code(new NativeCode(handle));
+        return code->code() ? std::move(code) : nullptr;
+    }
+
+    // Without a cache:
+    std::unique_ptr<NativeCode> build_temporary(const std::string& source) const {
+        const char* tmp = getenv("TMPDIR");
+        std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/brainfuck-cc.XXXXXX";
+        if (!mkdtemp(&dir[0])) throw CompilerFailed();
+
+        std::string source_path = dir + "/program.c", object_path = dir + "/program.so";
+        std::unique_ptr<NativeCode> code;
+        if (write_file(source_path, source) && build(source_path, object_path)) {
+            code = load(object_path);
+        }
+
+        unlink(source_path.c_str());
+        unlink(object_path.c_str());
+        rmdir(dir.c_str());
+        if (!code) throw CompilerFailed();
+        return code;
+    }
+
+public:
+    NativeBackend(std::string dir, size_t max_size = CodeCache::DefaultMaxSize)
+     : dir_(std::move(dir)), max_size_(max_size) {
+        const char* cc = getenv("CC");
+        compiler_ = cc && *cc ? cc : "cc";
+    }
+
+    // Throws CompilerFailed if it can't be built or loaded:
+    std::unique_ptr<NativeCode> compile(const std::string& source) const {
+        if (dir_.empty() || !CodeCache::make_dirs(dir_)) {
+            return build_temporary(source);
+        }
+
+        std::string contents = key(source);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx",
+                 (unsigned long long) fnv1a(contents.data(), contents.size()));
+        std::string base = dir_ + name;
+
+        std::string cached;
+        if (read_file(base + ".c", cached) && cached == contents) {
+            if (auto code = load(base + ".so", true)) {
+                // (see CodeCache::lookup)
+                utimensat(AT_FDCWD, (base + ".so").c_str(), nullptr, 0);
+                return code;
+            }
+        }
+
+        // Built under temporary names and renamed into place, the
+        // object first, so a source in the cache always has its object:
+        std::string temp = "." + std::to_string(getpid()) + ".tmp";
+        std::string source_path = base + temp + ".c", object_path = base + temp + ".so";
+        bool built = write_file(source_path, contents) &&
+                     build(source_path, object_path) &&
+                     rename(object_path.c_str(), (base + ".so").c_str()) == 0 &&
+                     rename(source_path.c_str(), (base + ".c").c_str()) == 0;
+        unlink(source_path.c_str());
+        unlink(object_path.c_str());
+        if (!built) throw CompilerFailed();
+
+        // (once loaded, it can be evicted)
+        auto code = load(base + ".so");
+        CodeCache(dir_, max_size_).evict();
+        if (!code) throw CompilerFailed();
+        return code;
+    }
+};
+
+#endif
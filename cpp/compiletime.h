@@ -0,0 +1,181 @@
+#ifndef BRAINFUCK_COMPILETIME_H
+#define BRAINFUCK_COMPILETIME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "adt.h"
+#include "io.h"
+#include "scan.h"
+#include "tape.h"
+
+// Programs known when building: the source is a string literal, parsed
+// and optimized by constexpr functions (the same operations as the ADT
+// version, with the repeated ones folded and [>], [<<], ... as scans),
+// and run by a template instantiated for each operation, so the whole
+// program becomes a single function the C++ compiler optimizes as any
+// other code. There's nothing left to do when it runs: no parsing, no
+// dispatch of any kind, just the loops.
+//
+//   static constexpr char source[] = "++++++++[>++++[>++>+++...";
+//   static constexpr auto program = ct::compile(source);
+//   ...
+//   ct::run<program>(IOPolicy());
+//
+// Unbalanced brackets are a compile error (compile() throws, so it's
+// not a constant expression).
+namespace ct {
+
+using adt::Operation;
+
+struct Op {
+    Operation operation;
+    int argument;
+    size_t next;        // index of the op after it (after its body, for loops)
+};
+
+// The ops, with a loop's body right after it. N is the size of the
+// source, which is as many ops as there can be:
+template <size_t N>
+struct Program {
+    Op ops[N] = {};
+    size_t size = 0;
+};
+
+template <size_t N>
+constexpr Program<N> compile(const char (&source)[N]) {
+    Program<N> program;
+    size_t open[N] = {};        // the loops not closed yet
+    size_t depth = 0;
+    size_t last = N;            // the last op of the current body, if any
+
+    auto add = [&](Operation operation) {
+        if (last != N && program.ops[last].operation == operation &&
+            (operation == Operation::Inc || operation == Operation::Dec ||
+             operation == Operation::Fwd || operation == Operation::Bwd)) {
+            ++program.ops[last].argument;
+            return;
+        }
+        last = program.size++;
+        program.ops[last] = {operation, 1, last + 1};
+    };
+
+    for (size_t i = 0; i < N && source[i]; ++i) {
+        switch (source[i]) {
+            case '+': add(Operation::Inc); break;
+            case '-': add(Operation::Dec); break;
+            case '>': add(Operation::Fwd); break;
+            case '<': add(Operation::Bwd); break;
+            case ',': add(Operation::Input); break;
+            case '.': add(Operation::Output); break;
+            case '[':
+                add(Operation::Loop);
+                open[depth++] = last;
+                last = N;
+                break;
+            case ']': {
+                    if (!depth) throw "unbalanced ']'";
+                    size_t loop = open[--depth];
+                    Op& body = program.ops[loop + 1];
+                    // [>], [<<], ... are scans:
+                    if (program.size == loop + 2 &&
+                        (body.operation == Operation::Fwd || body.operation == Operation::Bwd)) {
+                        program.ops[loop] = {body.operation == Operation::Fwd ?
+                                                 Operation::ScanRight : Operation::ScanLeft,
+                                             body.argument, loop + 1};
+                        program.size = loop + 1;
+                    } else {
+                        program.ops[loop].next = program.size;
+                    }
+                    last = loop;
+                }
+                break;
+        }
+    }
+
+    if (depth) throw "unbalanced '['";
+    return program;
+}
+
+// The ops directly in [begin, end) (a loop's inside ones are skipped):
+template <size_t N>
+constexpr size_t count(const Program<N>& program, size_t begin, size_t end) {
+    size_t count = 0;
+    for (size_t i = begin; i < end; i = program.ops[i].next) ++count;
+    return count;
+}
+
+template <size_t N>
+constexpr size_t nth(const Program<N>& program, size_t begin, size_t n) {
+    for (; n; --n) begin = program.ops[begin].next;
+    return begin;
+}
+
+// What the ops use, besides the current cell:
+struct Machine {
+    Tape& tape;
+    IOContext& io;
+};
+
+template <const auto& P, typename T, size_t Begin, size_t End>
+inline __attribute__((always_inline)) void run_block(T*& ptr, Machine& machine);
+
+template <const auto& P, typename T, size_t I>
+inline __attribute__((always_inline)) void run_op(T*& ptr, Machine& machine) {
+    constexpr Op op = P.ops[I];
+
+    if constexpr (op.operation == Operation::Inc) {
+        *ptr += op.argument;
+    } else if constexpr (op.operation == Operation::Dec) {
+        *ptr -= op.argument;
+    } else if constexpr (op.operation == Operation::Fwd) {
+        ptr += op.argument;
+    } else if constexpr (op.operation == Operation::Bwd) {
+        ptr -= op.argument;
+    } else if constexpr (op.operation == Operation::Input) {
+        int c;
+        if (machine.io.read(c)) *ptr = c;
+    } else if constexpr (op.operation == Operation::Output) {
+        machine.io.write(*ptr);
+    } else if constexpr (op.operation == Operation::Loop) {
+        while (*ptr) {
+            run_block<P, T, I + 1, op.next>(ptr, machine);
+        }
+    } else if constexpr (op.operation == Operation::ScanLeft) {
+        ptr = scan_bwd(ptr, machine.tape.begin<T>(), op.argument);
+    } else if constexpr (op.operation == Operation::ScanRight) {
+        ptr = scan_fwd(ptr, machine.tape.end<T>(), op.argument);
+    }
+}
+
+template <const auto& P, typename T, size_t Begin, size_t... K>
+inline __attribute__((always_inline)) void run_ops(T*& ptr, Machine& machine,
+                                                   std::index_sequence<K...>) {
+    (run_op<P, T, nth(P, Begin, K)>(ptr, machine), ...);
+}
+
+template <const auto& P, typename T, size_t Begin, size_t End>
+inline __attribute__((always_inline)) void run_block(T*& ptr, Machine& machine) {
+    run_ops<P, T, Begin>(ptr, machine, std::make_index_sequence<count(P, Begin, End)>());
+}
+
+// Runs a program from compile() (which has to be a constexpr variable
+// with static storage, to be a template argument):
+template <const auto& P, typename T = uint32_t>
+void run(IOPolicy policy, int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO) {
+    Tape tape(30000 * sizeof(T));
+    IOContext io(policy, in_fd, out_fd);
+    Machine machine = {tape, io};
+    T* ptr = tape.begin<T>();
+
+    try {
+        run_block<P, T, 0, P.size>(ptr, machine);
+    } catch (const EndOfInput&) {
+        // The input is over, and so is the program
+    }
+}
+
+} // namespace ct
+
+#endif
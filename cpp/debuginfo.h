@@ -0,0 +1,592 @@
+#ifndef BRAINFUCK_DEBUGINFO_H
+#define BRAINFUCK_DEBUGINFO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "brainfuck.h"
+#include "executable.h"
+#include "source.h"
+
+// Where each piece of the code generated by the JIT comes from, so the
+// usual tools can tell the loops of a program apart instead of seeing
+// an anonymous blob of memory. The code is split in symbols that don't
+// overlap: the prologue and the I/O subroutines (bf_runtime), the top
+// level of the program (bf_main) and each loop (bf_loop@LINE:COLUMN,
+// the position of its '['), without the loops inside it. Besides, each
+// node has a line entry with the position it was parsed from.
+//
+// The JIT fills it while compiling (see JITCompiler::map()), and it's
+// published with write_perf_map(), a JitDump and a GDBRegistration.
+class CodeMap
+{
+public:
+    struct Symbol {
+        size_t start;           // offsets in the code
+        size_t size;
+        std::string name;
+        std::string excerpt;    // of the source of a loop
+    };
+
+    struct Line {
+        size_t offset;
+        uint32_t line;
+        uint32_t column;
+    };
+
+private:
+    std::string path_;
+    std::string_view source_;
+    SourceLines lines_index_;
+
+    std::vector<Symbol> symbols_;
+    std::vector<Line> lines_;
+
+    // The symbols being emitted, innermost last, and where the code
+    // of the last one resumed:
+    std::vector<Symbol> open_;
+    size_t start_ = 0;
+
+    void close(size_t offset) {
+        if (!open_.empty() && offset > start_) {
+            const Symbol& symbol = open_.back();
+            symbols_.push_back({start_, offset - start_, symbol.name, symbol.excerpt});
+        }
+        start_ = offset;
+    }
+
+public:
+    // 'path' is the source file, as the debuggers should find it:
+    CodeMap(std::string path, std::string_view source)
+     : path_(path), source_(source), lines_index_(source) {}
+
+    // The code from 'offset' on is 'name', until the matching end()
+    // (the symbols can nest, the outer one resumes after it):
+    void begin(size_t offset, const std::string& name, const std::string& excerpt = "") {
+        close(offset);
+        open_.push_back({0, 0, name, excerpt});
+    }
+
+    void begin(size_t offset, const Loop& loop) {
+        begin(offset, "bf_loop@" + lines_index_.location(loop.position()),
+              excerpt(source_, loop.position(), 48));
+    }
+
+    void end(size_t offset) {
+        close(offset);
+        open_.pop_back();
+    }
+
+    // The code from 'offset' on comes from 'position' in the source:
+    void line(size_t offset, size_t position) {
+        Line line = {offset, (uint32_t) lines_index_.line(position),
+                     (uint32_t) lines_index_.column(position)};
+        // (a node with no code of its own)
+        if (!lines_.empty() && lines_.back().offset == offset) {
+            lines_.back() = line;
+        } else {
+            lines_.push_back(line);
+        }
+    }
+
+    const std::string& path() const {return path_;}
+    const std::vector<Symbol>& symbols() const {return symbols_;}
+    const std::vector<Line>& lines() const {return lines_;}
+
+    // The end of the last symbol:
+    size_t size() const {
+        return symbols_.empty() ? 0 : symbols_.back().start + symbols_.back().size;
+    }
+};
+
+// Appends the symbols of the code at 'base' to /tmp/perf-PID.map, where
+// perf looks for the code that doesn't come from a file (one line per
+// symbol: address, size and name, both in hex):
+inline bool write_perf_map(const CodeMap& map, const uint8_t* base) {
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    FILE* file = fopen(path.c_str(), "a");
+    if (!file) return false;
+
+    for (auto &symbol: map.symbols()) {
+        fprintf(file, "%llx %zx %s%s%s\n",
+                (unsigned long long) (uintptr_t) (base + symbol.start), symbol.size,
+                symbol.name.c_str(), symbol.excerpt.empty() ? "" : " ",
+                symbol.excerpt.c_str());
+    }
+
+    return fclose(file) == 0;
+}
+
+// A jitdump file (jit-PID.dump in $JITDUMPDIR, or /tmp), with a copy of
+// the code of each symbol and its line entries. perf finds it through
+// the executable mapping of its first page, and 'perf inject --jit'
+// turns it into an ELF file per symbol, with the lines, which 'perf
+// report' and 'perf annotate' can then use. The timestamps come from
+// CLOCK_MONOTONIC, so the samples have to use it too ('perf record -k
+// mono'). See tools/perf/Documentation/jitdump-specification.txt in
+// the Linux sources for the format.
+class JitDump
+{
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t total_size;
+        uint32_t elf_mach;
+        uint32_t pad1;
+        uint32_t pid;
+        uint64_t timestamp;
+        uint64_t flags;
+    };
+
+    struct RecordHeader {
+        uint32_t id;
+        uint32_t total_size;
+        uint64_t timestamp;
+    };
+
+    struct CodeLoad {
+        RecordHeader header;
+        uint32_t pid;
+        uint32_t tid;
+        uint64_t vma;
+        uint64_t code_addr;
+        uint64_t code_size;
+        uint64_t code_index;
+        // (followed by the name, and the code)
+    };
+
+    struct DebugInfo {
+        RecordHeader header;
+        uint64_t code_addr;
+        uint64_t nr_entry;
+        // (followed by the entries)
+    };
+
+    struct DebugEntry {
+        uint64_t addr;
+        uint32_t line;
+        uint32_t discrim;
+        // (followed by the file name)
+    };
+
+    static_assert(sizeof(FileHeader) == 40, "layout");
+    static_assert(sizeof(CodeLoad) == 56, "layout");
+    static_assert(sizeof(DebugInfo) == 32, "layout");
+
+    static const uint32_t Magic = 0x4a695444;       // "JiTD"
+    static const uint32_t CodeLoadRecord = 0;
+    static const uint32_t DebugInfoRecord = 2;
+    static const uint32_t CodeCloseRecord = 3;
+
+    std::string path_;
+    int fd_ = -1;
+    void* marker_ = MAP_FAILED;
+    size_t page_size_;
+    uint64_t index_ = 0;
+
+    static uint64_t timestamp() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    bool write(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*) data;
+        for (size_t written = 0; written < size;) {
+            ssize_t n = ::write(fd_, bytes + written, size - written);
+            if (n <= 0) return false;
+            written += n;
+        }
+        return true;
+    }
+
+    bool write_debug_info(const CodeMap& map, const CodeMap::Symbol& symbol,
+                          const uint8_t* base) {
+        std::string records;
+        uint64_t entries = 0;
+        for (auto &line: map.lines()) {
+            if (line.offset < symbol.start) continue;
+            if (line.offset >= symbol.start + symbol.size) break;
+            DebugEntry entry = {(uint64_t) (uintptr_t) (base + line.offset), line.line, 0};
+            records.append((const char*) &entry, sizeof(entry));
+            records.append(map.path().c_str(), map.path().size() + 1);
+            ++entries;
+        }
+        if (!entries) return true;
+
+        DebugInfo info;
+        info.header = {DebugInfoRecord, uint32_t(sizeof(info) + records.size()), timestamp()};
+        info.code_addr = (uint64_t) (uintptr_t) (base + symbol.start);
+        info.nr_entry = entries;
+        return write(&info, sizeof(info)) && write(records.data(), records.size());
+    }
+
+public:
+    JitDump() : page_size_(sysconf(_SC_PAGESIZE)) {
+        const char* dir = getenv("JITDUMPDIR");
+        path_ = std::string(dir && *dir ? dir : "/tmp") +
+                "/jit-" + std::to_string(getpid()) + ".dump";
+
+        fd_ = open(path_.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd_ == -1) return;
+
+        FileHeader header = {Magic, 1, sizeof(FileHeader), 62, 0,
+                             (uint32_t) getpid(), timestamp(), 0};
+        if (write(&header, sizeof(header))) {
+            marker_ = mmap(nullptr, page_size_, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd_, 0);
+        }
+    }
+
+    ~JitDump() {
+        if (marker_ != MAP_FAILED) {
+            RecordHeader close = {CodeCloseRecord, sizeof(RecordHeader), timestamp()};
+            write(&close, sizeof(close));
+            munmap(marker_, page_size_);
+        }
+        if (fd_ != -1) close(fd_);
+    }
+
+    JitDump(const JitDump&) = delete;
+    JitDump& operator=(const JitDump&) = delete;
+
+    explicit operator bool() const {return marker_ != MAP_FAILED;}
+
+    const std::string& path() const {return path_;}
+
+    // The line entries of each symbol go right before its code:
+    bool add(const CodeMap& map, const uint8_t* base) {
+        for (auto &symbol: map.symbols()) {
+            if (!write_debug_info(map, symbol, base)) return false;
+
+            std::string name = symbol.name;
+            CodeLoad load;
+            load.header = {CodeLoadRecord,
+                           uint32_t(sizeof(load) + name.size() + 1 + symbol.size),
+                           timestamp()};
+            load.pid = getpid();
+            load.tid = syscall(SYS_gettid);
+            load.vma = load.code_addr = (uint64_t) (uintptr_t) (base + symbol.start);
+            load.code_size = symbol.size;
+            load.code_index = index_++;
+
+            if (!write(&load, sizeof(load)) ||
+                !write(name.c_str(), name.size() + 1) ||
+                !write(base + symbol.start, symbol.size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// The GDB JIT interface: GDB puts a breakpoint in this function, and
+// reads the list of in-memory object files from this descriptor each
+// time it's called (the names and the layout are fixed by GDB, see
+// "JIT Compilation Interface" in its manual). LLDB reads them too.
+extern "C" {
+
+struct jit_code_entry {
+    jit_code_entry* next_entry;
+    jit_code_entry* prev_entry;
+    const char* symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;       // JIT_NOACTION, JIT_REGISTER_FN, JIT_UNREGISTER_FN
+    jit_code_entry* relevant_entry;
+    jit_code_entry* first_entry;
+};
+
+inline void __attribute__((noinline)) __jit_debug_register_code() {
+    __asm__ volatile("");
+}
+
+inline jit_descriptor __jit_debug_descriptor = {1, 0, nullptr, nullptr};
+
+}
+
+// Registers an object file for the code at 'base' with the debuggers,
+// for as long as it lives: the section of the code (with no contents,
+// just its address), a symbol for each of the CodeMap ones, and the
+// DWARF line table, so they can show the source lines of the code and
+// break on them ('break mandelbrot.bf:42'). There's no unwind info, so
+// backtraces may stop at the code.
+class GDBRegistration
+{
+private:
+    std::string object_;
+    jit_code_entry entry_;
+
+    enum Section {
+        Null, Text, SymTab, StrTab, DebugAbbrev, DebugInfo, DebugLine, ShStrTab,
+        Sections
+    };
+
+    static std::mutex& mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    template <typename T>
+    static void put(std::string& out, T value) {
+        out.append((const char*) &value, sizeof(value));
+    }
+
+    static void uleb(std::string& out, uint64_t value) {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            out += char(value ? byte | 0x80 : byte);
+        } while (value);
+    }
+
+    static void sleb(std::string& out, int64_t value) {
+        while (true) {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+                out += char(byte);
+                return;
+            }
+            out += char(byte | 0x80);
+        }
+    }
+
+    static void string(std::string& out, const std::string& value) {
+        out.append(value.c_str(), value.size() + 1);
+    }
+
+    // A compile unit for the whole code, without children:
+    static std::string debug_abbrev() {
+        std::string out;
+        uleb(out, 1);
+        uleb(out, 0x11);                    // DW_TAG_compile_unit
+        out += char(0);                     // DW_CHILDREN_no
+        uleb(out, 0x03); uleb(out, 0x08);   // DW_AT_name, DW_FORM_string
+        uleb(out, 0x13); uleb(out, 0x05);   // DW_AT_language, DW_FORM_data2
+        uleb(out, 0x11); uleb(out, 0x01);   // DW_AT_low_pc, DW_FORM_addr
+        uleb(out, 0x12); uleb(out, 0x07);   // DW_AT_high_pc, DW_FORM_data8
+        uleb(out, 0x10); uleb(out, 0x17);   // DW_AT_stmt_list, DW_FORM_sec_offset
+        uleb(out, 0); uleb(out, 0);
+        uleb(out, 0);
+        return out;
+    }
+
+    static std::string debug_info(const CodeMap& map, uint64_t base) {
+        std::string unit;
+        put<uint16_t>(unit, 4);             // DWARF 4
+        put<uint32_t>(unit, 0);             // .debug_abbrev offset
+        put<uint8_t>(unit, 8);              // address size
+        uleb(unit, 1);
+        string(unit, map.path());
+        put<uint16_t>(unit, 0x8001);        // DW_LANG_Mips_Assembler
+        put<uint64_t>(unit, base);
+        put<uint64_t>(unit, map.size());
+        put<uint32_t>(unit, 0);             // .debug_line offset
+
+        std::string out;
+        put<uint32_t>(out, unit.size());
+        return out + unit;
+    }
+
+    // The line program only uses the standard opcodes, one row per
+    // line entry:
+    static std::string debug_line(const CodeMap& map, uint64_t base) {
+        std::string header;
+        put<uint8_t>(header, 1);            // minimum_instruction_length
+        put<uint8_t>(header, 1);            // maximum_operations_per_instruction
+        put<uint8_t>(header, 1);            // default_is_stmt
+        put<int8_t>(header, -5);            // line_base
+        put<uint8_t>(header, 14);           // line_range
+        put<uint8_t>(header, 13);           // opcode_base
+        header.append("\0\1\1\1\1\0\0\0\1\0\0\1", 12);
+        header += char(0);                  // (no include_directories)
+        string(header, map.path());
+        uleb(header, 0);                    // directory, time, size
+        uleb(header, 0);
+        uleb(header, 0);
+        header += char(0);
+
+        std::string program;
+        if (!map.lines().empty()) {
+            program += char(0);             // DW_LNE_set_address
+            uleb(program, 9);
+            program += char(2);
+            put<uint64_t>(program, base + map.lines().front().offset);
+
+            size_t offset = map.lines().front().offset;
+            int64_t line = 1;
+            for (auto &entry: map.lines()) {
+                if (entry.offset != offset) {
+                    program += char(2);     // DW_LNS_advance_pc
+                    uleb(program, entry.offset - offset);
+                    offset = entry.offset;
+                }
+                if (entry.line != line) {
+                    program += char(3);     // DW_LNS_advance_line
+                    sleb(program, int64_t(entry.line) - line);
+                    line = entry.line;
+                }
+                program += char(5);         // DW_LNS_set_column
+                uleb(program, entry.column);
+                program += char(1);         // DW_LNS_copy
+            }
+
+            program += char(2);
+            uleb(program, map.size() - offset);
+            program += char(0);             // DW_LNE_end_sequence
+            uleb(program, 1);
+            program += char(1);
+        }
+
+        std::string unit;
+        put<uint16_t>(unit, 4);
+        put<uint32_t>(unit, header.size());
+        unit += header + program;
+
+        std::string out;
+        put<uint32_t>(out, unit.size());
+        return out + unit;
+    }
+
+    // A relocatable object, since there are no segments to load (the
+    // code is already there), with everything at its final address:
+    static std::string object(const CodeMap& map, uint64_t base) {
+        std::string strtab(1, '\0'), symtab(sizeof(ELFSymbol), '\0');
+        for (auto &symbol: map.symbols()) {
+            ELFSymbol entry = {(uint32_t) strtab.size(), 0x12, 0, Text,
+                               base + symbol.start, symbol.size}; // STB_GLOBAL, STT_FUNC
+            string(strtab, symbol.name);
+            put(symtab, entry);
+        }
+
+        const char* names[] = {"", ".text", ".symtab", ".strtab", ".debug_abbrev",
+                               ".debug_info", ".debug_line", ".shstrtab"};
+        std::string shstrtab;
+        uint32_t name_offsets[Sections];
+        for (size_t i = 0; i < Sections; ++i) {
+            name_offsets[i] = shstrtab.size();
+            string(shstrtab, names[i]);
+        }
+
+        std::string contents[Sections] = {"", "", symtab, strtab, debug_abbrev(),
+                                          debug_info(map, base), debug_line(map, base),
+                                          shstrtab};
+
+        ELFSectionHeader sections[Sections];
+        memset(sections, 0, sizeof(sections));
+        std::string out(sizeof(ELFHeader), '\0');
+        for (size_t i = 1; i < Sections; ++i) {
+            out.resize((out.size() + 7) & ~size_t(7));
+            sections[i].name = name_offsets[i];
+            sections[i].type = 1;           // SHT_PROGBITS
+            sections[i].offset = out.size();
+            sections[i].size = contents[i].size();
+            sections[i].addralign = 1;
+            out += contents[i];
+        }
+
+        sections[Text].type = 8;            // SHT_NOBITS
+        sections[Text].flags = 6;           // SHF_ALLOC|SHF_EXECINSTR
+        sections[Text].addr = base;
+        sections[Text].size = map.size();
+        sections[Text].addralign = 16;
+        sections[SymTab].type = 2;          // SHT_SYMTAB
+        sections[SymTab].link = StrTab;
+        sections[SymTab].info = 1;          // (the first global one)
+        sections[SymTab].addralign = 8;
+        sections[SymTab].entsize = sizeof(ELFSymbol);
+        sections[StrTab].type = sections[ShStrTab].type = 3; // SHT_STRTAB
+
+        out.resize((out.size() + 7) & ~size_t(7));
+        ELFHeader header = elf_header(1);   // ET_REL
+        header.shoff = out.size();
+        header.shentsize = sizeof(ELFSectionHeader);
+        header.shnum = Sections;
+        header.shstrndx = ShStrTab;
+        out.replace(0, sizeof(header), (const char*) &header, sizeof(header));
+        out.append((const char*) sections, sizeof(sections));
+        return out;
+    }
+
+public:
+    GDBRegistration(const CodeMap& map, const uint8_t* base)
+     : object_(object(map, (uint64_t) (uintptr_t) base)) {
+        entry_.prev_entry = nullptr;
+        entry_.symfile_addr = object_.data();
+        entry_.symfile_size = object_.size();
+
+        std::lock_guard<std::mutex> lock(mutex());
+        entry_.next_entry = __jit_debug_descriptor.first_entry;
+        if (entry_.next_entry) {
+            entry_.next_entry->prev_entry = &entry_;
+        }
+        __jit_debug_descriptor.first_entry = &entry_;
+        __jit_debug_descriptor.relevant_entry = &entry_;
+        __jit_debug_descriptor.action_flag = 1;     // JIT_REGISTER_FN
+        __jit_debug_register_code();
+    }
+
+    ~GDBRegistration() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (entry_.prev_entry) {
+            entry_.prev_entry->next_entry = entry_.next_entry;
+        } else {
+            __jit_debug_descriptor.first_entry = entry_.next_entry;
+        }
+        if (entry_.next_entry) {
+            entry_.next_entry->prev_entry = entry_.prev_entry;
+        }
+        __jit_debug_descriptor.relevant_entry = &entry_;
+        __jit_debug_descriptor.action_flag = 2;     // JIT_UNREGISTER_FN
+        __jit_debug_register_code();
+    }
+
+    GDBRegistration(const GDBRegistration&) = delete;
+    GDBRegistration& operator=(const GDBRegistration&) = delete;
+
+    // The object file, as the debuggers see it:
+    const std::string& object() const {return object_;}
+};
+
+// --perf-map, --jitdump and --gdb-jit (see above):
+struct DebugOptions
+{
+    bool perf_map = false;
+    bool jitdump = false;
+    bool gdb = false;
+
+    bool parse(const std::string& option) {
+        if (option == "--perf-map") {
+            perf_map = true;
+        } else if (option == "--jitdump") {
+            jitdump = true;
+        } else if (option == "--gdb-jit") {
+            gdb = true;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    bool enabled() const {return perf_map || jitdump || gdb;}
+};
+
+#endif
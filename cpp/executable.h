@@ -0,0 +1,154 @@
+#ifndef BRAINFUCK_EXECUTABLE_H
+#define BRAINFUCK_EXECUTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+
+// The ELF structures (64-bit only) are declared here instead of using
+// <elf.h>, so they also build on macOS:
+struct ELFHeader {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+struct ELFProgramHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+};
+
+struct ELFSectionHeader {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t addralign;
+    uint64_t entsize;
+};
+
+struct ELFSymbol {
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+};
+
+static_assert(sizeof(ELFHeader) == 64, "layout");
+static_assert(sizeof(ELFProgramHeader) == 56, "layout");
+static_assert(sizeof(ELFSectionHeader) == 64, "layout");
+static_assert(sizeof(ELFSymbol) == 24, "layout");
+
+// Fills in the identification and the fields all of them share:
+inline ELFHeader elf_header(uint16_t type) {
+    ELFHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.ident, "\x7f" "ELF", 4);
+    header.ident[4] = 2;                // ELFCLASS64
+    header.ident[5] = 1;                // ELFDATA2LSB
+    header.ident[6] = 1;                // EV_CURRENT
+    header.type = type;
+    header.machine = 62;                // EM_X86_64
+    header.version = 1;
+    header.ehsize = sizeof(ELFHeader);
+    return header;
+}
+
+// A static x86-64 Linux executable with the bare minimum to run a
+// piece of position-independent code: a read/exec segment with the
+// headers and the code (the entry point is somewhere in it), and a
+// read/write segment of zeroed memory (the .bss) right after it.
+// There's no section table, symbols or dynamic linking, so writing
+// one takes no assembler or linker.
+class ELFExecutable
+{
+private:
+
+    static const uint64_t BaseAddress = 0x400000;
+    static const uint64_t PageSize = 0x1000;
+    static const size_t HeadersSize = sizeof(ELFHeader) + 2 * sizeof(ELFProgramHeader);
+    // The code starts at a cache line (some of it is aligned):
+    static const size_t TextOffset = (HeadersSize + 63) & ~size_t(63);
+
+    size_t text_size_;
+    size_t bss_size_;
+
+public:
+    ELFExecutable(size_t text_size, size_t bss_size)
+     : text_size_(text_size), bss_size_(bss_size) {}
+
+    // Where the first byte of the code and the .bss get loaded:
+    uint64_t text_address() const {return BaseAddress + TextOffset;}
+    uint64_t bss_address() const {
+        return (BaseAddress + TextOffset + text_size_ + PageSize - 1)
+               & ~(PageSize - 1);
+    }
+
+    // Writes the executable to 'path', with 'entry' the offset of the
+    // entry point inside 'text'. Returns false (with errno set) if the
+    // file can't be written:
+    bool write(const char* path, const uint8_t* text, size_t entry) const {
+        ELFHeader header = elf_header(2); // ET_EXEC
+        header.entry = text_address() + entry;
+        header.phoff = sizeof(ELFHeader);
+        header.phentsize = sizeof(ELFProgramHeader);
+        header.phnum = 2;
+
+        ELFProgramHeader segments[2];
+        memset(segments, 0, sizeof(segments));
+        // The text segment maps the whole file, headers included:
+        segments[0].type = 1;           // PT_LOAD
+        segments[0].flags = 5;          // PF_R|PF_X
+        segments[0].vaddr = segments[0].paddr = BaseAddress;
+        segments[0].filesz = segments[0].memsz = TextOffset + text_size_;
+        segments[0].align = PageSize;
+        // And the .bss nothing, it's all zeroes:
+        segments[1].type = 1;           // PT_LOAD
+        segments[1].flags = 6;          // PF_R|PF_W
+        segments[1].vaddr = segments[1].paddr = bss_address();
+        segments[1].memsz = bss_size_;
+        segments[1].align = PageSize;
+
+        uint8_t padding[TextOffset - HeadersSize] = {};
+
+        FILE* file = fopen(path, "wb");
+        if (!file) return false;
+
+        bool written =
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(segments, sizeof(segments), 1, file) == 1 &&
+            fwrite(padding, sizeof(padding), 1, file) == 1 &&
+            fwrite(text, 1, text_size_, file) == text_size_;
+
+        if (fclose(file) != 0 || !written) return false;
+        return chmod(path, 0755) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef BRAINFUCK_IO_H
+#define BRAINFUCK_IO_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+// When the buffered output is written, besides when the buffer is full
+// and at the end of the program:
+enum class FlushPolicy {
+    Exit,       // never (fastest, but prompts may not show up)
+    Input,      // before blocking on input, so prompts are shown
+    Newline,    // before blocking on input and after every newline
+};
+
+// What ',' does once the input is over. By default the program ends
+// there (what the programs in ../programs expect), otherwise it stores
+// a value in the cell, or leaves it as it was:
+enum class EOFPolicy {
+    Exit,
+    Zero,
+    MinusOne,   // all ones, in any cell width
+    Unchanged,
+};
+
+struct IOPolicy
+{
+    FlushPolicy flush = FlushPolicy::Input;
+    EOFPolicy eof = EOFPolicy::Exit;
+
+    // Takes --flush=exit|input|newline and --eof=exit|0|-1|unchanged, and
+    // returns whether the option was one of them:
+    bool parse(const std::string& option) {
+        if (option == "--flush=exit") {
+            flush = FlushPolicy::Exit;
+        } else if (option == "--flush=input") {
+            flush = FlushPolicy::Input;
+        } else if (option == "--flush=newline") {
+            flush = FlushPolicy::Newline;
+        } else if (option == "--eof=exit") {
+            eof = EOFPolicy::Exit;
+        } else if (option == "--eof=0") {
+            eof = EOFPolicy::Zero;
+        } else if (option == "--eof=-1") {
+            eof = EOFPolicy::MinusOne;
+        } else if (option == "--eof=unchanged") {
+            eof = EOFPolicy::Unchanged;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
+
+// The buffers of an IOContext. The code generated by the JIT works on
+// them directly (keeping a pointer to them in %rbx), so the interpreters
+// and the JIT can share the same context. The opcodes hardcode the
+// offsets of the fields, so the layout must not change:
+struct IOBuffers
+{
+    static const uint32_t BufferSize = 0x10000;
+
+    uint64_t out_len;
+    uint64_t in_pos;
+    uint64_t in_len;
+    int32_t in_fd;          // (stdin and stdout, unless serving
+    int32_t out_fd;         // a connection, see brainfuck-server)
+    uint8_t out[BufferSize];
+    uint8_t in[BufferSize];
+};
+
+static_assert(offsetof(IOBuffers, out_len) == 0x00, "layout");
+static_assert(offsetof(IOBuffers, in_pos)  == 0x08, "layout");
+static_assert(offsetof(IOBuffers, in_len)  == 0x10, "layout");
+static_assert(offsetof(IOBuffers, in_fd)   == 0x18, "layout");
+static_assert(offsetof(IOBuffers, out_fd)  == 0x1c, "layout");
+static_assert(offsetof(IOBuffers, out)     == 0x20, "layout");
+static_assert(offsetof(IOBuffers, in)      == 0x10020, "layout");
+
+// Thrown by IOContext::read() to end the program when the input is over
+// (with EOFPolicy::Exit), and caught by the runners:
+struct EndOfInput {};
+
+// Buffered stdin/stdout for the interpreters, going straight to the
+// file descriptors: '.' only appends to the output buffer and ','
+// consumes the input buffer, so the kernel is entered only when one of
+// them is full/empty, or when the flush policy says so. Any pending
+// output is written when the context is destroyed.
+class IOContext
+{
+public:
+    static const size_t BufferSize = IOBuffers::BufferSize;
+
+    IOContext(IOPolicy policy = IOPolicy(),
+              int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO)
+     : buffers_(), policy_(policy) {
+        buffers_.in_fd = in_fd;
+        buffers_.out_fd = out_fd;
+    }
+
+    ~IOContext() {flush();}
+
+    IOContext(const IOContext&) = delete;
+    IOContext& operator=(const IOContext&) = delete;
+
+    const IOPolicy& policy() const {return policy_;}
+    IOBuffers* buffers() {return &buffers_;}
+
+    inline void write(uint8_t c) {
+        buffers_.out[buffers_.out_len++] = c;
+        if (buffers_.out_len == BufferSize ||
+            (c == '\n' && policy_.flush == FlushPolicy::Newline)) {
+            flush();
+        }
+    }
+
+    // Reads the next byte into 'c', or the value the EOF policy says
+    // once the input is over. Returns false if the cell has to be left
+    // unchanged instead:
+    inline bool read(int& c) {
+        if (buffers_.in_pos == buffers_.in_len && !fill()) {
+            if (policy_.eof == EOFPolicy::Exit) throw EndOfInput();
+            c = policy_.eof == EOFPolicy::MinusOne ? -1 : 0;
+            return policy_.eof != EOFPolicy::Unchanged;
+        }
+        c = buffers_.in[buffers_.in_pos++];
+        return true;
+    }
+
+    // Writes a whole block, after any pending output:
+    void write(const void* data, size_t size) {
+        flush();
+        write_all(buffers_.out_fd, (const uint8_t*) data, size);
+    }
+
+    void flush() {
+        write_all(buffers_.out_fd, buffers_.out, buffers_.out_len);
+        buffers_.out_len = 0;
+    }
+
+private:
+    IOBuffers buffers_;
+    IOPolicy policy_;
+
+    // (calls interrupted by a signal are retried, instead of taking them
+    // for the end of the input or a failed write)
+    static void write_all(int fd, const uint8_t* ptr, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, ptr, size);
+            if (written == -1 && errno == EINTR) continue;
+            if (written <= 0) break;
+            ptr += written;
+            size -= written;
+        }
+    }
+
+    bool fill() {
+        if (policy_.flush != FlushPolicy::Exit) {
+            flush();
+        }
+        ssize_t count;
+        do {
+            count = ::read(buffers_.in_fd, buffers_.in, BufferSize);
+        } while (count == -1 && errno == EINTR);
+        if (count <= 0) return false;
+        buffers_.in_pos = 0;
+        buffers_.in_len = count;
+        return true;
+    }
+};
+
+#endif
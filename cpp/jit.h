@@ -0,0 +1,804 @@
+#ifndef BRAINFUCK_JIT_H
+#define BRAINFUCK_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "brainfuck.h"
+#include "debuginfo.h"
+#include "executable.h"
+#include "io.h"
+#include "profile.h"
+#include "scan.h"
+#include "tape.h"
+#include "x86.h"
+
+// The generated code talks to the kernel directly, so it has to know
+// which syscall numbers to use. macOS exposes the BSD syscalls with
+// the 0x2000000 class prefix, Linux uses its own table:
+enum class OSABI {
+    Darwin,
+    Linux,
+};
+
+#if defined(__APPLE__)
+const OSABI NativeABI = OSABI::Darwin;
+#else
+const OSABI NativeABI = OSABI::Linux;
+#endif
+
+inline uint32_t sys_read(OSABI abi) {
+    return abi == OSABI::Darwin ? 0x02000003 : 0;
+}
+
+inline uint32_t sys_write(OSABI abi) {
+    return abi == OSABI::Darwin ? 0x02000004 : 1;
+}
+
+class JITProgram
+{
+private:
+    ExecutableBuffer &buf_;
+    x86::Assembler as_;
+    OSABI abi_;
+    size_t cell_;
+    IOPolicy io_;
+    x86::Label flush_,
+               write_out_,
+               read_byte_;
+
+public:
+    JITProgram(ExecutableBuffer &buf, OSABI abi = NativeABI, size_t cell = 4,
+               IOPolicy io = IOPolicy())
+      : buf_(buf),
+        as_(buf),
+        abi_(abi),
+        cell_(cell),
+        io_(io) {}
+
+    ExecutableBuffer& buffer() {return buf_;}
+    x86::Assembler& assembler() {return as_;}
+
+    // Size of the cells, in bytes (1, 2 or 4):
+    size_t cell() const {return cell_;}
+
+    const IOPolicy& io() const {return io_;}
+
+    // Entry points of the I/O subroutines emitted by start():
+    uint8_t* flush() const {return flush_.target();}
+    uint8_t* read_byte() const {return read_byte_.target();}
+
+    // The instructions below are the ones in brainfuck.s, which also
+    // has the encodings (the assembler picks the shortest ones, so the
+    // generated code can be denser than the dump):
+    void start() {
+        using namespace x86;
+
+        // as_.int3();
+
+        // The program is called as f(memory, context) (see Code). Keep
+        // the context in %rbx (callee-saved, so it's restored in
+        // finish()) and jump over the I/O subroutines:
+        Label body;
+        as_.push(rbx);
+        as_.mov(rbx, rsi);
+        as_.jmp(body);
+
+        // Writes the pending output (or, from write_out, the %rdx bytes
+        // at %rsi), retrying on short and interrupted writes:
+        Label write, written;
+        as_.bind(flush_);
+        as_.lea(rsi, qword_ptr(rbx, offsetof(IOBuffers, out)));
+        as_.mov(rdx, qword_ptr(rbx, offsetof(IOBuffers, out_len)));
+        as_.mov(qword_ptr(rbx, offsetof(IOBuffers, out_len)), 0);
+        as_.bind(write_out_);
+        as_.push(rdi);
+        as_.bind(write);
+        as_.test(rdx, rdx);
+        as_.j(Cond::LE, written, Distance::Short);
+        as_.mov(eax, sys_write(abi_));
+        as_.mov(edi, ptr(4, rbx, offsetof(IOBuffers, out_fd)));
+        as_.syscall();
+        check_syscall(write, written);
+        as_.add(rsi, rax);
+        as_.sub(rdx, rax);
+        as_.jmp(write);
+        as_.bind(written);
+        as_.pop(rdi);
+        as_.ret();
+
+        // Returns the next input byte in %eax (with CF clear), flushing
+        // the output before blocking on a read unless --flush=exit (and
+        // reading again if a signal interrupts it). On
+        // EOF it drops its own return address and leaves through the
+        // epilogue, ending the whole program (as the interpreters do with
+        // --eof=exit), or returns the EOF value with CF set otherwise:
+        Label buffered, read, eof;
+        as_.bind(read_byte_);
+        as_.mov(rax, qword_ptr(rbx, offsetof(IOBuffers, in_pos)));
+        as_.cmp(rax, qword_ptr(rbx, offsetof(IOBuffers, in_len)));
+        as_.j(Cond::B, buffered, Distance::Short);
+        if (io_.flush != FlushPolicy::Exit) {
+            as_.call(flush_);
+        }
+        as_.bind(read);
+        as_.push(rdi);
+        as_.mov(eax, sys_read(abi_));
+        as_.mov(edi, ptr(4, rbx, offsetof(IOBuffers, in_fd)));
+        as_.lea(rsi, qword_ptr(rbx, offsetof(IOBuffers, in)));
+        as_.mov(edx, IOBuffers::BufferSize);
+        as_.syscall();
+        as_.pop(rdi);
+        check_syscall(read, eof);
+        as_.mov(qword_ptr(rbx, offsetof(IOBuffers, in_len)), rax);
+        as_.xor_(eax, eax);
+        as_.bind(buffered);
+        as_.movzx(ecx, byte_ptr(rbx, rax, offsetof(IOBuffers, in)));
+        as_.inc(rax);
+        as_.mov(qword_ptr(rbx, offsetof(IOBuffers, in_pos)), rax);
+        as_.mov(eax, ecx);
+        as_.clc();
+        as_.ret();
+        as_.bind(eof);
+        if (io_.eof == EOFPolicy::Exit) {
+            as_.add(rsp, 8);
+            as_.call(flush_);
+            as_.xor_(eax, eax);
+            as_.pop(rbx);
+            as_.ret();
+        } else {
+            // (read_byte_eof)
+            as_.mov(eax, io_.eof == EOFPolicy::MinusOne ? 0xffffffff : 0);
+            as_.stc();
+            as_.ret();
+        }
+
+        as_.bind(body);
+    }
+
+    // After a read or a write: jumps back to 'retry' if a signal
+    // interrupted it (EINTR, which Linux returns as -4 in %rax, and
+    // Darwin as 4 with CF set), and to 'failed' on any other error or
+    // on a zero count:
+    void check_syscall(x86::Label& retry, x86::Label& failed) {
+        using namespace x86;
+
+        if (abi_ == OSABI::Darwin) {
+            Label ok;
+            as_.j(Cond::AE, ok, Distance::Short);
+            as_.cmp(rax, 4);
+            as_.j(Cond::E, retry, Distance::Short);
+            as_.jmp(failed, Distance::Short);
+            as_.bind(ok);
+        } else {
+            as_.cmp(rax, -4);
+            as_.j(Cond::E, retry, Distance::Short);
+        }
+        as_.test(rax, rax);
+        as_.j(Cond::LE, failed, Distance::Short);
+    }
+
+    // Writes 'size' bytes, embedded in the code, straight to the output
+    // (there must be nothing pending):
+    void write_constant(const void* data, size_t size) {
+        using namespace x86;
+
+        Label bytes, after;
+        as_.jmp(after);
+        as_.bind(bytes);
+        as_.bytes(data, size);
+        as_.bind(after);
+        as_.lea(rsi, bytes);
+        as_.mov(rdx, size);
+        as_.call(write_out_);
+    }
+
+    // Code that runs a piece of the program, instead of all of it,
+    // leaves the pending output in the buffer for whoever goes on:
+    void finish(bool flush = true) {
+        using namespace x86;
+
+        if (flush) {
+            as_.call(flush_);
+        }
+        as_.mov(rax, rdi);
+        as_.pop(rbx);
+        as_.ret();
+    }
+
+    // Writes the compiled program (after finish()) as a standalone
+    // Linux executable: the code is position-independent, so it only
+    // needs an entry point that sets up the same things run() does.
+    // The I/O context goes in the .bss, and the tape is mapped with a
+    // guard at each side, but it doesn't grow (there's no signal
+    // handler), the whole reservation is accessible from the start:
+    bool write_elf(const char* path) {
+        using namespace x86;
+
+        uint8_t *base = buf_.get_base(),
+                *entry = buf_.get_ptr();
+
+        // (elf_entry)
+        Label failed, exit;
+        as_.mov(eax, 9);                                // mmap
+        as_.xor_(edi, edi);
+        as_.mov(esi, 2 * Tape::GuardSize + Tape::DefaultReserve);
+        as_.xor_(edx, edx);                             // PROT_NONE
+        as_.mov(r10d, 0x4022);          // MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE
+        as_.mov(r8, -1);
+        as_.xor_(r9d, r9d);
+        as_.syscall();
+        as_.test(rax, rax);
+        as_.j(Cond::S, failed, Distance::Short);
+        as_.lea(rdi, qword_ptr(rax, Tape::GuardSize));
+        as_.mov(esi, Tape::DefaultReserve);
+        as_.mov(edx, 3);                                // PROT_READ|PROT_WRITE
+        as_.mov(eax, 10);                               // mprotect
+        as_.syscall();
+        as_.test(rax, rax);
+        as_.j(Cond::NE, failed, Distance::Short);
+        as_.add(rdi, Tape::Padding);
+        as_.lea(rsi, rip_ptr(8, 0));                    // context(%rip)
+        uint8_t *after_context = buf_.get_ptr();
+        as_.mov(ptr(4, rsi, offsetof(IOBuffers, out_fd)), 1); // (stdin is 0)
+        as_.call(base);
+        as_.xor_(edi, edi);
+        as_.jmp(exit, Distance::Short);
+        as_.bind(failed);
+        as_.mov(edi, 1);
+        as_.bind(exit);
+        as_.mov(eax, 231);                              // exit_group
+        as_.syscall();
+
+        // Now that the size of the code is known, so is the address
+        // of the .bss, which is where the context is:
+        uint8_t *end = buf_.get_ptr();
+        ELFExecutable elf(end - base, sizeof(IOBuffers));
+        buf_.set_ptr(after_context - 4);
+        buf_.writel(elf.bss_address() -
+                    (elf.text_address() + (after_context - base)));
+        buf_.set_ptr(end);
+
+        return elf.write(path, base, entry - base);
+    }
+
+    // Size of the generated code so far:
+    size_t size() const {return buf_.get_ptr() - buf_.get_base();}
+
+    // The generated code takes the address of the current cell (in
+    // the rdi reg) and the I/O buffers (in rsi), and returns the
+    // address of the current cell once done, or NULL if the program
+    // ended because the input was over:
+    typedef uint8_t* (*Code)(uint8_t* memory, IOBuffers* context);
+
+    // The entry point, once finish()ed:
+    Code code() {
+        // Set the buffer as executable before attempting to jump
+        // into it:
+        buf_.make_executable();
+
+        return (Code) buf_.get_base();
+    }
+
+    bool run() {
+        return execute(code(), cell_, io_);
+    }
+
+    // Runs a whole program generated by this class, from this buffer
+    // or from somewhere else (like the code cache). Returns false if
+    // it goes out of its tape (which only ends the calling thread's
+    // program, so several can run at once):
+    static bool execute(Code code, size_t cell, IOPolicy policy,
+                        int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO) {
+        // The generated code does no bounds checks: the guard pages
+        // of the tape take care of that (and make it grow if needed):
+        Tape tape(30000 * cell);
+
+        std::unique_ptr<IOContext> context(new IOContext(policy, in_fd, out_fd));
+
+        return Tape::recover([&] {code(tape.begin(), context->buffers());});
+    }
+};
+
+// How the compiler lays out loops (everything is on by default, and
+// --no-loop-opt turns it all off):
+struct JITTuning
+{
+    // Loops jump to a single test at the bottom, instead of testing
+    // both before entering and after each iteration:
+    bool rotate_loops = true;
+    // The heads of the innermost loops start at a multiple of this
+    // (0 to disable). When rotated, the padding is never run:
+    size_t align_loops = 16;
+    // A cell used by consecutive arithmetic stays in %edx, and is only
+    // written back before moves, I/O, scans and loop tests:
+    bool cache_cell = true;
+
+    bool parse(const std::string& option) {
+        if (option == "--no-loop-opt") {
+            rotate_loops = false;
+            align_loops = 0;
+            cache_cell = false;
+        } else if (option == "--no-rotate") {
+            rotate_loops = false;
+        } else if (option == "--align-loops=0") {
+            align_loops = 0;
+        } else if (option == "--align-loops=16") {
+            align_loops = 16;
+        } else if (option == "--align-loops=32") {
+            align_loops = 32;
+        } else if (option == "--no-cell-cache") {
+            cache_cell = false;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    std::string key() const {
+        return "rotate=" + std::to_string(rotate_loops) +
+               " align=" + std::to_string(align_loops) +
+               " cache_cell=" + std::to_string(cache_cell);
+    }
+};
+
+class JITCompiler : public ExpressionVisitor
+{
+private:
+    JITProgram &program_;
+    x86::Assembler &as_;
+    size_t cell_;
+    bool avx2_;
+    JITTuning tuning_;
+    Profile* profile_ = nullptr;
+    CodeMap* map_ = nullptr;
+
+    // The cell kept in %edx (zero-extended), if any, and whether it
+    // has to be written back:
+    bool cached_ = false;
+    ssize_t cached_at_ = 0;
+    bool dirty_ = false;
+
+    // The cell 'at' cells away from the current one, and %eax with the
+    // size of a cell (%al, %ax or %eax):
+    x86::Mem cell(ssize_t at) const {return x86::ptr(cell_, x86::rdi, at*cell_);}
+    x86::Reg cell_eax() const {return x86::eax.sized(cell_);}
+    x86::Reg cell_edx() const {return x86::edx.sized(cell_);}
+
+    bool is_cached(ssize_t at) const {return cached_ && cached_at_ == at;}
+
+    // Writes the cached cell back, keeping it cached:
+    void write_back() {
+        if (cached_ && dirty_) {
+            as_.mov(cell(cached_at_), cell_edx());
+            dirty_ = false;
+        }
+    }
+
+    // Writes the cached cell back and forgets it (before anything
+    // that moves %rdi, clobbers %edx or jumps around):
+    void uncache() {
+        write_back();
+        cached_ = false;
+    }
+
+    // Loads a cell in %edx, replacing the one there:
+    void cache(ssize_t at) {
+        uncache();
+        as_.movzx(x86::edx, cell(at));
+        cached_ = true;
+        cached_at_ = at;
+    }
+
+    // movabsq $counter, %rax; incq (%rax) (the flags and %eax are dead
+    // between nodes, and %edx is left alone):
+    void count(uint64_t* counter) {
+        as_.mov(x86::rax, (int64_t) counter);
+        as_.inc(x86::qword_ptr(x86::rax, 0));
+    }
+
+    // Compiles a node, telling the CodeMap where its code comes from:
+    void emit(const Expression& node) {
+        if (map_) {
+            map_->line(program_.size(), node.position());
+        }
+        node.accept(*this);
+    }
+
+    static bool innermost(const Loop& loop) {
+        for(const auto &child: loop.children()) {
+            if (dynamic_cast<const Loop*>(child)) return false;
+        }
+        return true;
+    }
+
+public:
+    JITCompiler(JITProgram &program, bool avx2 = has_avx2(),
+                JITTuning tuning = JITTuning())
+      : program_(program),
+        as_(program_.assembler()),
+        cell_(program_.cell()),
+        avx2_(avx2),
+        tuning_(tuning) {}
+
+    // Makes the code count the entries and iterations of each loop in
+    // 'profile' (see profile.h). The addresses of the counters are
+    // embedded in the code, so it can't be cached or written out:
+    void profile(Profile* profile) {profile_ = profile;}
+
+    // Records where each piece of the code comes from in 'map' (see
+    // debuginfo.h), which doesn't change the code:
+    void map(CodeMap* map) {map_ = map;}
+
+    virtual void visit(const Increment& inc) {
+        // addl $value, offset4(%rdi) (or %edx if cached)
+        if (is_cached(inc.at())) {
+            as_.add(cell_edx(), inc.offset());
+            dirty_ = true;
+        } else {
+            as_.add(cell(inc.at()), inc.offset());
+        }
+    }
+
+    virtual void visit(const Decrement& dec) {
+        // subl $value, offset4(%rdi) (or %edx if cached)
+        if (is_cached(dec.at())) {
+            as_.sub(cell_edx(), dec.offset());
+            dirty_ = true;
+        } else {
+            as_.sub(cell(dec.at()), dec.offset());
+        }
+    }
+
+    virtual void visit(const Forward& fwd) {
+        // addq $value4, %rdi
+        uncache();
+        as_.add(x86::rdi, fwd.offset()*cell_);
+    }
+
+    virtual void visit(const Backward& bwd) {
+        // subq $value4, %rdi
+        uncache();
+        as_.sub(x86::rdi, bwd.offset()*cell_);
+    }
+
+    virtual void visit(const Input& input) {
+        // callq read_byte; movl %eax, offset4(%rdi), and with
+        // --eof=unchanged, EOF (CF set) skips the store:
+        x86::Label skip;
+        uncache();
+        as_.call(program_.read_byte());
+        bool unchanged = program_.io().eof == EOFPolicy::Unchanged;
+        if (unchanged) {
+            as_.j(x86::Cond::B, skip, x86::Distance::Short);
+        }
+        as_.mov(cell(input.at()), cell_eax());
+        if (unchanged) {
+            as_.bind(skip);
+        }
+    }
+
+    virtual void visit(const Output& output) {
+        using namespace x86;
+
+        // Append the low byte of the cell to the output buffer, and
+        // flush it once it's full (or after a newline, with
+        // --flush=newline, see write_newline):
+        Label flush, skip;
+        uncache();
+        as_.mov(rax, qword_ptr(rbx, offsetof(IOBuffers, out_len)));
+        as_.mov(cl, byte_ptr(rdi, output.at()*cell_));
+        as_.mov(byte_ptr(rbx, rax, offsetof(IOBuffers, out)), cl);
+        as_.inc(rax);
+        as_.mov(qword_ptr(rbx, offsetof(IOBuffers, out_len)), rax);
+        as_.cmp(rax, IOBuffers::BufferSize);
+        if (program_.io().flush == FlushPolicy::Newline) {
+            as_.j(Cond::E, flush, Distance::Short);
+            as_.cmp(cl, '\n');
+        }
+        as_.j(Cond::NE, skip, Distance::Short);
+        as_.bind(flush);
+        as_.call(program_.flush());
+        as_.bind(skip);
+    }
+
+    virtual void visit(const Loop& loop) {
+        // The body can be of any size, so the forward jump takes a
+        // rel32, while the one back is short if the body is. Rotated,
+        // it's 'jmp test; start: body; test: cmp; jne start' instead
+        // (see loop_rotated):
+        x86::Label start, test, end;
+        uncache();
+        if (map_) {
+            map_->begin(program_.size(), loop);
+        }
+        if (profile_) {
+            count(profile_->entries(loop));
+        }
+        if (tuning_.rotate_loops) {
+            as_.jmp(test);
+        } else {
+            as_.cmp(cell(0), 0);
+            as_.j(x86::Cond::E, end);
+        }
+        if (tuning_.align_loops && innermost(loop)) {
+            as_.align(tuning_.align_loops);
+        }
+        as_.bind(start);
+        if (profile_) {
+            count(profile_->iterations(loop));
+        }
+
+        // Recurse into subexpressions:
+        for(const auto &child: loop.children()) {
+            emit(*child);
+        }
+
+        uncache();
+        // (the test is the loop's)
+        if (map_) {
+            map_->line(program_.size(), loop.position());
+        }
+        as_.bind(test);
+        as_.cmp(cell(0), 0);
+        as_.j(x86::Cond::NE, start);
+        as_.bind(end);
+        if (map_) {
+            map_->end(program_.size());
+        }
+    }
+
+    virtual void visit(const SetZero& zero) {
+        // movl $0, offset4(%rdi) (or xorl %edx, %edx if cached)
+        if (is_cached(zero.at())) {
+            as_.xor_(x86::edx, x86::edx);
+            dirty_ = true;
+        } else {
+            as_.mov(cell(zero.at()), 0);
+        }
+    }
+
+    virtual void visit(const ScanLeft& scan) {
+        uncache();
+        if (size_t(scan.stride()) <= vector_width()) {
+            vector_scan(scan.stride(), true);
+        } else {
+            scalar_scan(scan.stride(), true);
+        }
+    }
+
+    virtual void visit(const ScanRight& scan) {
+        uncache();
+        if (size_t(scan.stride()) <= vector_width()) {
+            vector_scan(scan.stride(), false);
+        } else {
+            scalar_scan(scan.stride(), false);
+        }
+    }
+
+    virtual void visit(const MulAdd& muladd) {
+        // movl offset4(%rdi), %eax; imull $factor, %eax, %eax;
+        // addl %eax, offset4(%rdi) (zero-extending narrower cells).
+        // The source is usually the same for a few of them in a row
+        // (and then set to zero), so it's loaded once in %edx:
+        const ssize_t target = muladd.at() + muladd.offset();
+        if (tuning_.cache_cell) {
+            if (!is_cached(muladd.at())) {
+                cache(muladd.at());
+            }
+            as_.imul(x86::eax, x86::edx, muladd.factor());
+        } else {
+            as_.movzx(x86::eax, cell(muladd.at()));
+            as_.imul(x86::eax, x86::eax, muladd.factor());
+        }
+        if (is_cached(target)) {
+            as_.add(cell_edx(), cell_eax());
+            dirty_ = true;
+        } else {
+            as_.add(cell(target), cell_eax());
+        }
+    }
+
+    // The scan loops without vectors (see scan_left/scan_right):
+    void scalar_scan(size_t stride, bool backward) {
+        x86::Label loop, done;
+        as_.cmp(cell(0), 0);
+        as_.j(x86::Cond::E, done, x86::Distance::Short);
+        as_.bind(loop);
+        if (!backward) {
+            as_.add(x86::rdi, stride*cell_);
+        } else {
+            as_.sub(x86::rdi, stride*cell_);
+        }
+        as_.cmp(cell(0), 0);
+        as_.j(x86::Cond::NE, loop);
+        as_.bind(done);
+    }
+
+    // Vector width, in bytes and in cells:
+    size_t vector_bytes() const {return avx2_ ? 32 : 16;}
+    size_t vector_width() const {return vector_bytes() / cell_;}
+
+    uint32_t vector_mask(size_t stride, bool backward) const {
+        switch (cell_) {
+            case 1: return scan_mask<uint8_t>(vector_width(), stride, backward);
+            case 2: return scan_mask<uint16_t>(vector_width(), stride, backward);
+            default: return scan_mask<uint32_t>(vector_width(), stride, backward);
+        }
+    }
+
+    // Same approach as scan_fwd/scan_bwd in scan.h: compare a vector
+    // of cells against zero, keep only the lanes the loop would visit
+    // (see scan_mask()) and advance past the last of them. The left
+    // scan loads the vector that ends at the current cell and uses bsr
+    // to find the last zero lane, and the AVX2 versions are the same
+    // with the VEX-encoded instructions and a vzeroupper once done (see
+    // scan_right_sse2 and the others in brainfuck.s):
+    void vector_scan(size_t stride, bool backward) {
+        using namespace x86;
+
+        const size_t width = vector_width();
+        const size_t step = scan_lanes(width, stride) * stride;
+        const uint32_t mask = vector_mask(stride, backward);
+        const Mem vector = ptr(vector_bytes(), rdi,
+                               backward ? -(ssize_t)((width - 1)*cell_) : 0);
+
+        // Skip everything if the current cell is already zero:
+        Label loop, found, done;
+        as_.cmp(cell(0), 0);
+        as_.j(Cond::E, done, Distance::Short);
+
+        if (!avx2_) {
+            as_.pxor(xmm1, xmm1);
+            as_.bind(loop);
+            as_.movdqu(xmm0, vector);
+            as_.pcmpeq(cell_, xmm0, xmm1);
+            as_.pmovmskb(eax, xmm0);
+        } else {
+            as_.vpxor(ymm1, ymm1, ymm1);
+            as_.bind(loop);
+            as_.vmovdqu(ymm0, vector);
+            as_.vpcmpeq(cell_, ymm0, ymm0, ymm1);
+            as_.vpmovmskb(eax, ymm0);
+        }
+
+        as_.and_(eax, mask);
+        as_.j(Cond::NE, found, Distance::Short);
+        if (!backward) {
+            as_.add(rdi, step*cell_);
+        } else {
+            as_.sub(rdi, step*cell_);
+        }
+        as_.jmp(loop);
+
+        // Found a zero, move to its lane: bsf gives the first byte of
+        // the first lane, bsr the last byte of the last one:
+        as_.bind(found);
+        if (avx2_) {
+            as_.vzeroupper();
+        }
+        if (!backward) {
+            as_.bsf(eax, eax);
+            as_.add(rdi, rax);
+        } else {
+            as_.bsr(eax, eax);
+            as_.lea(rdi, ptr(8, rdi, rax, -(int32_t)(vector_bytes() - 1)));
+        }
+        as_.bind(done);
+    }
+
+    // With a Prefix, the code starts by writing its output and the
+    // cells it left (see prefix):
+    void compile(const ExpressionList& expressions,
+                 const Prefix& prefix = Prefix()) {
+        if (map_) {
+            map_->begin(program_.size(), "bf_runtime");
+        }
+        program_.start();
+        if (map_) {
+            map_->end(program_.size());
+            map_->begin(program_.size(), "bf_main");
+        }
+
+        // prefix:
+        //   jmp 1f; .ascii "output"; 1: leaq -N(%rip), %rsi;
+        //   movq $N, %rdx; callq write_out
+        //   movl $value, offset4(%rdi) (for each non-zero cell)
+        //   addq $position4, %rdi
+        if (!prefix.output.empty()) {
+            program_.write_constant(prefix.output.data(), prefix.output.size());
+        }
+        if (!prefix.complete) {
+            for (size_t i = 0; i < prefix.cells.size(); ++i) {
+                if (prefix.cells[i]) as_.mov(cell(i), prefix.cells[i]);
+            }
+            if (prefix.position) {
+                as_.add(x86::rdi, prefix.position*cell_);
+            }
+        }
+
+        for(const auto &expression: expressions) {
+            emit(*expression);
+        }
+
+        uncache();
+        program_.finish();
+        if (map_) {
+            map_->end(program_.size());
+        }
+    }
+
+    // Compiles a single node (a loop, usually) to be run in the middle
+    // of the program, so the output isn't flushed when it's done:
+    void compile(const Expression& expression) {
+        program_.start();
+        emit(expression);
+        uncache();
+        program_.finish(false);
+    }
+
+    // Size of a buffer big enough for the code of 'expressions' (or of
+    // a single node), whatever the options: no node takes more than
+    // MaxNodeSize bytes (plus the counters of loops, with a profile),
+    // and the subroutines and the entry points take way less than a
+    // page:
+    static size_t code_size(const ExpressionList& expressions,
+                            const Prefix& prefix = Prefix(),
+                            bool profile = false) {
+        NodeCounter counter;
+        for(const auto &expression: expressions) {
+            expression->accept(counter);
+        }
+        return FixedSize + counter.count() * MaxNodeSize +
+               (profile ? counter.loops() * MaxCountersSize : 0) +
+               prefix.output.size() + prefix.cells.size() * MaxStoreSize;
+    }
+
+    static size_t code_size(const Expression& expression) {
+        NodeCounter counter;
+        expression.accept(counter);
+        return FixedSize + counter.count() * MaxNodeSize;
+    }
+
+private:
+    static const size_t MaxNodeSize = 96;
+    static const size_t MaxStoreSize = 12;
+    static const size_t MaxCountersSize = 2 * 13;
+    static const size_t FixedSize = 4096;
+
+    class NodeCounter : public ExpressionVisitor
+    {
+    private:
+        size_t count_ = 0;
+        size_t loops_ = 0;
+
+    public:
+        size_t count() const {return count_;}
+        size_t loops() const {return loops_;}
+
+        virtual void visit(const Increment&) {++count_;}
+        virtual void visit(const Decrement&) {++count_;}
+        virtual void visit(const Forward&)   {++count_;}
+        virtual void visit(const Backward&)  {++count_;}
+        virtual void visit(const Input&)     {++count_;}
+        virtual void visit(const Output&)    {++count_;}
+        virtual void visit(const SetZero&)   {++count_;}
+        virtual void visit(const ScanLeft&)  {++count_;}
+        virtual void visit(const ScanRight&) {++count_;}
+        virtual void visit(const MulAdd&)    {++count_;}
+
+        virtual void visit(const Loop& loop) {
+            ++count_;
+            ++loops_;
+            for(const auto &child: loop.children()) {
+                child->accept(*this);
+            }
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef BRAINFUCK_PASSES_H
+#define BRAINFUCK_PASSES_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "brainfuck.h"
+
+// The front end of every engine built on brainfuck.h: the Parser, and
+// then the optimization passes, always in the order below. Which ones
+// run depends on the level (-O0 runs none of them, the parser still
+// folds repeated operations, and each level adds the passes that start
+// at it, up to -O3, the default, which runs them all), and each one can
+// also be turned on or off on its own, whatever the level:
+//
+//   ./brainfuck-jit -O2 --enable-pass=prefix ../programs/mandelbrot.bf
+//
+// --time-passes reports how long the parse and each pass took, and
+// how many nodes the program had after each of them.
+enum class Pass {
+    Simplify,
+    Idioms,
+    Offsets,
+    Prefix
+};
+
+struct PassInfo {
+    Pass pass;
+    const char* name;
+    int level;      // (the lowest one it runs at)
+};
+
+static const PassInfo Passes[] = {
+    {Pass::Simplify, "simplify", 1},    // Simplifier
+    {Pass::Idioms,   "idioms",   1},    // IdiomRecognizer
+    {Pass::Offsets,  "offsets",  2},    // OffsetFolder
+    {Pass::Prefix,   "prefix",   3},    // PartialEvaluator
+};
+
+static const size_t PassCount = sizeof(Passes) / sizeof(Passes[0]);
+
+// Reads the number an option takes (what follows its '='), and returns
+// whether it's valid: just digits, and not over 'max'. The drivers
+// reject options with anything else, instead of going on with a wrong
+// value (or dying of an uncaught std::stoul exception):
+inline bool parse_number(const std::string& value, size_t& number, size_t max = SIZE_MAX) {
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    errno = 0;
+    unsigned long long parsed = strtoull(value.c_str(), nullptr, 10);
+    if (errno == ERANGE || parsed > max) return false;
+    number = parsed;
+    return true;
+}
+
+// (the same, for fractional values)
+inline bool parse_number(const std::string& value, double& number) {
+    if (value.empty() || value.find_first_not_of("0123456789.") != std::string::npos) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    double parsed = strtod(value.c_str(), &end);
+    if (errno == ERANGE || *end) return false;
+    number = parsed;
+    return true;
+}
+
+struct PassOptions
+{
+    static const int MaxLevel = 3;
+
+    int level = MaxLevel;
+    size_t budget = PartialEvaluator::DefaultBudget;
+    bool time_passes = false;
+
+    // For each pass: 1 or 0 when it's been turned on or off by name,
+    // -1 to go by the level:
+    std::vector<int> forced = std::vector<int>(PassCount, -1);
+
+    bool parse(const std::string& option) {
+        if (option.size() == 3 && option.compare(0, 2, "-O") == 0 &&
+            option[2] >= '0' && option[2] <= '0' + MaxLevel) {
+            level = option[2] - '0';
+        } else if (option.compare(0, 14, "--enable-pass=") == 0) {
+            return force(option.substr(14), 1);
+        } else if (option.compare(0, 15, "--disable-pass=") == 0) {
+            return force(option.substr(15), 0);
+        } else if (option.compare(0, 16, "--prefix-budget=") == 0) {
+            return parse_number(option.substr(16), budget);
+        } else if (option == "--time-passes") {
+            time_passes = true;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    bool enabled(Pass pass) const {
+        const PassInfo& info = Passes[size_t(pass)];
+        int force = forced[size_t(pass)];
+        return force == -1 ? level >= info.level : force == 1;
+    }
+
+    // What the passes that run make of the program depends on (for
+    // caches of compiled code):
+    std::string key() const {
+        std::string key = "passes=";
+        for (auto &info: Passes) {
+            if (enabled(info.pass)) key += std::string(info.name) + ",";
+        }
+        return key + " budget=" + std::to_string(enabled(Pass::Prefix) ? budget : 0);
+    }
+
+private:
+    // Takes a list of names, separated by commas:
+    bool force(const std::string& names, int value) {
+        std::stringstream list(names);
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            size_t i = 0;
+            while (i < PassCount && name != Passes[i].name) ++i;
+            if (i == PassCount) return false;
+            forced[i] = value;
+        }
+        return true;
+    }
+};
+
+// Parses a program and runs the enabled passes on it, keeping the
+// prefix the partial evaluation leaves (an empty one if it didn't
+// run) and how long each step took (and the nodes left, only counted
+// for --time-passes).
+class PassManager
+{
+public:
+    PassManager(const PassOptions& options, size_t cell)
+     : options_(options), evaluator_(cell, options.budget) {}
+    ~PassManager() = default;
+
+    Program parse(std::string_view source);
+    Program optimize(Program&&);
+    Program run(std::string_view source) {return optimize(parse(source));}
+
+    const Prefix& prefix() const {return evaluator_.prefix();}
+
+    struct Step {
+        const char* name;
+        double ms;
+        size_t nodes;
+    };
+
+    // In the order they ran:
+    const std::vector<Step>& steps() const {return steps_;}
+
+    void report(std::ostream&) const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    PassOptions options_;
+    PartialEvaluator evaluator_;
+    std::vector<Step> steps_;
+    Clock::time_point start_;
+
+    Program run(Pass, Program&&);
+
+    void lap(const char* name, const Program& program) {
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start_).count();
+        steps_.push_back({name, ms, options_.time_passes ? nodes(program.expressions()) : 0});
+    }
+
+    static size_t nodes(const ExpressionList& expressions) {
+        size_t count = expressions.size();
+        for (auto expression: expressions) {
+            if (auto loop = dynamic_cast<const Loop*>(expression)) {
+                count += nodes(loop->children());
+            }
+        }
+        return count;
+    }
+};
+
+Program PassManager::parse(std::string_view source) {
+    start_ = Clock::now();
+    Program program = Parser().parse(source);
+    lap("parse", program);
+    return program;
+}
+
+Program PassManager::optimize(Program&& program) {
+    for (auto &info: Passes) {
+        if (!options_.enabled(info.pass)) continue;
+        start_ = Clock::now();
+        program = run(info.pass, std::move(program));
+        lap(info.name, program);
+    }
+    return std::move(program);
+}
+
+Program PassManager::run(Pass pass, Program&& program) {
+    switch (pass) {
+        case Pass::Simplify: return Simplifier().rewrite(std::move(program));
+        case Pass::Idioms:  return IdiomRecognizer().rewrite(std::move(program));
+        case Pass::Offsets: return OffsetFolder().rewrite(std::move(program));
+        case Pass::Prefix:  return evaluator_.rewrite(std::move(program));
+    }
+    return std::move(program);
+}
+
+// (written at once, so reports from different threads don't mix)
+void PassManager::report(std::ostream& os) const {
+    std::ostringstream report;
+    double total = 0;
+
+    report << std::left << std::setw(10) << "pass" << std::right
+           << std::setw(12) << "ms" << std::setw(10) << "nodes" << std::endl
+           << std::fixed << std::setprecision(3);
+    for (auto &step: steps_) {
+        report << std::left << std::setw(10) << step.name << std::right
+               << std::setw(12) << step.ms << std::setw(10) << step.nodes << std::endl;
+        total += step.ms;
+    }
+    report << std::left << std::setw(10) << "total" << std::right
+           << std::setw(12) << total << std::endl;
+
+    os << report.str() << std::flush;
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef BRAINFUCK_PROFILE_H
+#define BRAINFUCK_PROFILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "brainfuck.h"
+#include "source.h"
+
+// Where a program spends its time, by loop. Each loop has a pair of
+// counters: how many times it was entered, and how many iterations it
+// ran. Nodes don't need counters of their own, since all the nodes of
+// a loop body run once per iteration, so the nodes run in each loop
+// ("self", not counting the ones of the loops inside it) come out of
+// its iterations and the size of its body.
+//
+// The counters are bumped by ProfilingRunner (below) or by the code
+// the JIT generates with a profile (see JITCompiler::profile()), so
+// neither the Runner nor the code compiled without one pay anything
+// for it.
+class Profile
+{
+private:
+    struct LoopInfo {
+        const Loop* loop;
+        size_t parent;          // index of the enclosing loop, or None
+        size_t body;            // nodes directly in the body
+    };
+
+    static const size_t None = ~size_t(0);
+
+    std::vector<LoopInfo> loops_;
+    std::unordered_map<const Loop*, size_t> index_;
+    // entries and iterations of each loop, in pairs (it never grows
+    // once built, so the JIT can embed their addresses):
+    std::vector<uint64_t> counters_;
+    size_t top_;                // nodes at the top level
+
+    void add(const ExpressionList& expressions, size_t parent) {
+        for (auto expression: expressions) {
+            if (auto loop = dynamic_cast<const Loop*>(expression)) {
+                size_t index = loops_.size();
+                loops_.push_back({loop, parent, loop->children().size()});
+                index_[loop] = index;
+                add(loop->children(), index);
+            }
+        }
+    }
+
+    uint64_t self(size_t index) const {return iterations(index) * loops_[index].body;}
+    uint64_t entries(size_t index) const {return counters_[2*index];}
+    uint64_t iterations(size_t index) const {return counters_[2*index + 1];}
+
+    // Self plus the nodes of all the loops inside:
+    std::vector<uint64_t> totals() const {
+        std::vector<uint64_t> totals(loops_.size());
+        // (children always come after their parent)
+        for (size_t i = loops_.size(); i-- > 0;) {
+            totals[i] += self(i);
+            if (loops_[i].parent != None) {
+                totals[loops_[i].parent] += totals[i];
+            }
+        }
+        return totals;
+    }
+
+    std::string frame(std::string_view source, const SourceLines& lines, size_t index) const {
+        size_t position = loops_[index].loop->position();
+        return excerpt(source, position, 24) + "@" + lines.location(position);
+    }
+
+public:
+    Profile(const ExpressionList& expressions) : top_(expressions.size()) {
+        add(expressions, None);
+        counters_.resize(2 * loops_.size());
+    }
+
+    uint64_t* entries(const Loop& loop) {return &counters_[2 * index_.at(&loop)];}
+    uint64_t* iterations(const Loop& loop) {return &counters_[2 * index_.at(&loop) + 1];}
+
+    // The loops that ran the most nodes themselves, with where they
+    // are in the source ('precomputed' is the number of nodes the
+    // PartialEvaluator ran at compile time):
+    void report(std::ostream& os, std::string_view source,
+                size_t precomputed = 0, size_t count = 20) const {
+        std::vector<uint64_t> total = totals();
+        SourceLines lines(source);
+        uint64_t all = top_;
+        for (size_t i = 0; i < loops_.size(); ++i) {
+            if (loops_[i].parent == None) all += total[i];
+        }
+
+        std::vector<size_t> order(loops_.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return self(a) > self(b);
+        });
+
+        os << "Profile: " << all << " nodes run in " << loops_.size() << " loops"
+           << " (and " << precomputed << " at compile time)" << std::endl
+           << std::setw(7) << "self%" << std::setw(15) << "self" << std::setw(15) << "total"
+           << std::setw(14) << "iterations" << std::setw(11) << "entries"
+           << "  " << std::left << std::setw(10) << "line:col" << "loop" << std::right << std::endl;
+
+        for (size_t i = 0; i < order.size() && i < count; ++i) {
+            size_t index = order[i];
+            if (!entries(index)) break;
+            size_t position = loops_[index].loop->position();
+            os << std::fixed << std::setprecision(1) << std::setw(6)
+               << (all ? 100.0 * self(index) / all : 0) << "%"
+               << std::setw(15) << self(index) << std::setw(15) << total[index]
+               << std::setw(14) << iterations(index) << std::setw(11) << entries(index)
+               << "  " << std::left << std::setw(10) << lines.location(position)
+               << excerpt(source, position, 48) << std::right << std::endl;
+        }
+    }
+
+    // One line per loop with the nodes it ran, and the loops it's in
+    // (';'-separated, outermost first), the input of flamegraph.pl and
+    // most flame graph viewers:
+    bool write_folded(const char* path, std::string_view source) const {
+        std::ofstream file(path);
+        SourceLines lines(source);
+        file << "main " << top_ << std::endl;
+        for (size_t i = 0; i < loops_.size(); ++i) {
+            if (!self(i)) continue;
+            std::string stack = frame(source, lines, i);
+            for (size_t parent = loops_[i].parent; parent != None; parent = loops_[parent].parent) {
+                stack = frame(source, lines, parent) + ";" + stack;
+            }
+            file << "main;" << stack << " " << self(i) << std::endl;
+        }
+        return bool(file);
+    }
+};
+
+// --profile prints a report to stderr at the end, and
+// --profile-folded=FILE writes the folded stacks to FILE:
+struct ProfileOptions
+{
+    bool enabled = false;
+    std::string folded;
+
+    bool parse(const std::string& option) {
+        if (option == "--profile") {
+            enabled = true;
+        } else if (option.compare(0, 17, "--profile-folded=") == 0) {
+            enabled = true;
+            folded = option.substr(17);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void report(const Profile& profile, std::string_view source, size_t precomputed) const {
+        profile.report(std::cerr, source, precomputed);
+        if (!folded.empty() && !profile.write_folded(folded.c_str(), source)) {
+            perror(folded.c_str());
+        }
+    }
+};
+
+// Runs a program on a Runner, counting the entries and iterations of
+// each loop in a Profile (the rest of the nodes run as usual):
+template <typename T>
+class ProfilingRunner : public ExpressionVisitor
+{
+private:
+    Runner<T>& runner_;
+    Profile& profile_;
+
+public:
+    ProfilingRunner(Runner<T>& runner, Profile& profile)
+     : runner_(runner), profile_(profile) {}
+
+    virtual void visit(const Increment& node) {node.run(runner_);}
+    virtual void visit(const Decrement& node) {node.run(runner_);}
+    virtual void visit(const Forward& node)   {node.run(runner_);}
+    virtual void visit(const Backward& node)  {node.run(runner_);}
+    virtual void visit(const Input& node)     {node.run(runner_);}
+    virtual void visit(const Output& node)    {node.run(runner_);}
+    virtual void visit(const SetZero& node)   {node.run(runner_);}
+    virtual void visit(const ScanLeft& node)  {node.run(runner_);}
+    virtual void visit(const ScanRight& node) {node.run(runner_);}
+    virtual void visit(const MulAdd& node)    {node.run(runner_);}
+
+    virtual void visit(const Loop& loop) {
+        uint64_t& iterations = *profile_.iterations(loop);
+        ++*profile_.entries(loop);
+        while (runner_.memory().read() > 0) {
+            ++iterations;
+            for (const auto &child: loop.children()) {
+                child->accept(*this);
+            }
+        }
+    }
+
+    void run(const ExpressionList& expressions) {
+        try {
+            for (const auto &expression: expressions) {
+                expression->accept(*this);
+            }
+        } catch (const EndOfInput&) {
+            // The input is over, and so is the program
+        }
+    }
+};
+
+#endif
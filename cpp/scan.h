@@ -0,0 +1,183 @@
+#ifndef BRAINFUCK_SCAN_H
+#define BRAINFUCK_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_SIMD 1
+#endif
+
+// Vectorized search for the first zero cell, as needed by the scan
+// loops ([>], [<<], ...). Each compare checks a whole vector of cells
+// (16 bytes with SSE2, 32 with AVX2, picked at runtime), and strides
+// larger than one cell are handled by only looking at the lanes the
+// loop would have visited: with W cells per vector and a stride of S,
+// the first ceil(W/S) lanes at multiples of S are checked, and the
+// next compare starts right after the last of them, so the lanes of
+// interest are always in the same positions. Strides wider than a
+// vector fall back to the plain loop.
+//
+// [begin, end) are the bounds of the tape: vector loads never cross
+// them, the remaining cells near the edges are checked one by one.
+
+template <typename T>
+inline T* scan_fwd_scalar(T* ptr, size_t stride) {
+    while (*ptr) ptr += stride;
+    return ptr;
+}
+
+template <typename T>
+inline T* scan_bwd_scalar(T* ptr, size_t stride) {
+    while (*ptr) ptr -= stride;
+    return ptr;
+}
+
+#ifdef SCAN_SIMD
+
+// Lanes checked per compare for the given vector width (in cells):
+inline size_t scan_lanes(size_t width, size_t stride) {
+    return (width + stride - 1) / stride;
+}
+
+// movemask() gives one bit per byte, so each checked lane contributes
+// sizeof(T) bits. Forward scans look at lanes 0, S, 2S... backward
+// scans at lanes W-1, W-1-S, ...
+template <typename T>
+inline uint32_t scan_mask(size_t width, size_t stride, bool backward) {
+    uint32_t lane = (1u << sizeof(T)) - 1, mask = 0;
+    for (size_t i = 0; i < scan_lanes(width, stride); ++i) {
+        size_t index = backward ? width - 1 - i * stride : i * stride;
+        mask |= lane << (index * sizeof(T));
+    }
+    return mask;
+}
+
+template <typename T>
+inline __m128i cmpeq_zero_sse2(__m128i v) {
+    switch (sizeof(T)) {
+        case 1: return _mm_cmpeq_epi8(v, _mm_setzero_si128());
+        case 2: return _mm_cmpeq_epi16(v, _mm_setzero_si128());
+        default: return _mm_cmpeq_epi32(v, _mm_setzero_si128());
+    }
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+inline __m256i cmpeq_zero_avx2(__m256i v) {
+    switch (sizeof(T)) {
+        case 1: return _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+        case 2: return _mm256_cmpeq_epi16(v, _mm256_setzero_si256());
+        default: return _mm256_cmpeq_epi32(v, _mm256_setzero_si256());
+    }
+}
+
+template <typename T>
+T* scan_fwd_sse2(T* ptr, T* end, size_t stride) {
+    const size_t width = sizeof(__m128i) / sizeof(T);
+    if (stride > width) return scan_fwd_scalar(ptr, stride);
+
+    const size_t step = scan_lanes(width, stride) * stride;
+    const uint32_t mask = scan_mask<T>(width, stride, false);
+
+    for (; end - ptr >= (ptrdiff_t) width; ptr += step) {
+        __m128i cells = _mm_loadu_si128((const __m128i*) ptr);
+        uint32_t zeros = _mm_movemask_epi8(cmpeq_zero_sse2<T>(cells)) & mask;
+        if (zeros) return ptr + __builtin_ctz(zeros) / sizeof(T);
+    }
+
+    return scan_fwd_scalar(ptr, stride);
+}
+
+template <typename T>
+T* scan_bwd_sse2(T* ptr, T* begin, size_t stride) {
+    const size_t width = sizeof(__m128i) / sizeof(T);
+    if (stride > width) return scan_bwd_scalar(ptr, stride);
+
+    const size_t step = scan_lanes(width, stride) * stride;
+    const uint32_t mask = scan_mask<T>(width, stride, true);
+
+    for (; ptr - begin >= (ptrdiff_t) width - 1; ptr -= step) {
+        T* base = ptr - (width - 1);
+        __m128i cells = _mm_loadu_si128((const __m128i*) base);
+        uint32_t zeros = _mm_movemask_epi8(cmpeq_zero_sse2<T>(cells)) & mask;
+        if (zeros) return base + (31 - __builtin_clz(zeros)) / sizeof(T);
+    }
+
+    return scan_bwd_scalar(ptr, stride);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+T* scan_fwd_avx2(T* ptr, T* end, size_t stride) {
+    const size_t width = sizeof(__m256i) / sizeof(T);
+    if (stride > width) return scan_fwd_scalar(ptr, stride);
+
+    const size_t step = scan_lanes(width, stride) * stride;
+    const uint32_t mask = scan_mask<T>(width, stride, false);
+
+    for (; end - ptr >= (ptrdiff_t) width; ptr += step) {
+        __m256i cells = _mm256_loadu_si256((const __m256i*) ptr);
+        uint32_t zeros = _mm256_movemask_epi8(cmpeq_zero_avx2<T>(cells)) & mask;
+        if (zeros) return ptr + __builtin_ctz(zeros) / sizeof(T);
+    }
+
+    return scan_fwd_scalar(ptr, stride);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+T* scan_bwd_avx2(T* ptr, T* begin, size_t stride) {
+    const size_t width = sizeof(__m256i) / sizeof(T);
+    if (stride > width) return scan_bwd_scalar(ptr, stride);
+
+    const size_t step = scan_lanes(width, stride) * stride;
+    const uint32_t mask = scan_mask<T>(width, stride, true);
+
+    for (; ptr - begin >= (ptrdiff_t) width - 1; ptr -= step) {
+        T* base = ptr - (width - 1);
+        __m256i cells = _mm256_loadu_si256((const __m256i*) base);
+        uint32_t zeros = _mm256_movemask_epi8(cmpeq_zero_avx2<T>(cells)) & mask;
+        if (zeros) return base + (31 - __builtin_clz(zeros)) / sizeof(T);
+    }
+
+    return scan_bwd_scalar(ptr, stride);
+}
+
+inline bool has_avx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+template <typename T>
+inline T* scan_fwd(T* ptr, T* end, size_t stride) {
+    if (*ptr == 0) return ptr;
+    return has_avx2() ? scan_fwd_avx2(ptr, end, stride)
+                      : scan_fwd_sse2(ptr, end, stride);
+}
+
+template <typename T>
+inline T* scan_bwd(T* ptr, T* begin, size_t stride) {
+    if (*ptr == 0) return ptr;
+    return has_avx2() ? scan_bwd_avx2(ptr, begin, stride)
+                      : scan_bwd_sse2(ptr, begin, stride);
+}
+
+#else
+
+inline bool has_avx2() {return false;}
+
+template <typename T>
+inline T* scan_fwd(T* ptr, T*, size_t stride) {
+    return scan_fwd_scalar(ptr, stride);
+}
+
+template <typename T>
+inline T* scan_bwd(T* ptr, T*, size_t stride) {
+    return scan_bwd_scalar(ptr, stride);
+}
+
+#endif
+
+#endif
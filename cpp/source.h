@@ -0,0 +1,109 @@
+#ifndef BRAINFUCK_SOURCE_H
+#define BRAINFUCK_SOURCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The source of a program, mapped read-only into memory instead of
+// being read into a buffer: the parsers go through it only once, so
+// they can read it straight from the page cache without any copy.
+class SourceFile
+{
+private:
+    const char* data_;
+    size_t size_;
+    bool valid_;
+
+public:
+    SourceFile(const char* filename)
+     : data_(nullptr), size_(0), valid_(false) {
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size_ = st.st_size;
+            // (empty files can't be mapped, but are valid programs)
+            if (size_ == 0) {
+                valid_ = true;
+            } else {
+                void* data = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    madvise(data, size_, MADV_SEQUENTIAL);
+                    data_ = (const char*) data;
+                    valid_ = true;
+                }
+            }
+        }
+
+        close(fd);
+    }
+
+    ~SourceFile() {
+        if (data_) munmap((void*) data_, size_);
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    explicit operator bool() const {return valid_;}
+
+    std::string_view view() const {return std::string_view(data_, size_);}
+};
+
+// The lines and columns (both from 1) of the offsets in a source:
+class SourceLines
+{
+private:
+    std::vector<size_t> starts_;
+
+public:
+    SourceLines(std::string_view source) : starts_(1, 0) {
+        for (size_t i = 0; i < source.size(); ++i) {
+            if (source[i] == '\n') starts_.push_back(i + 1);
+        }
+    }
+
+    size_t line(size_t position) const {
+        return std::upper_bound(starts_.begin(), starts_.end(), position) - starts_.begin();
+    }
+
+    size_t column(size_t position) const {
+        return position - starts_[line(position) - 1] + 1;
+    }
+
+    // "line:column":
+    std::string location(size_t position) const {
+        return std::to_string(line(position)) + ":" + std::to_string(column(position));
+    }
+};
+
+// The loop (or node) at 'position', without comments and cut to
+// 'length':
+inline std::string excerpt(std::string_view source, size_t position, size_t length) {
+    std::string text;
+    int depth = 0;
+    for (size_t i = position; i < source.size(); ++i) {
+        char c = source[i];
+        if (std::string_view("+-<>,.[]").find(c) == std::string_view::npos) continue;
+        if (text.size() == length) {
+            text.replace(length - 3, 3, "...");
+            break;
+        }
+        text += c;
+        if (c == '[') ++depth;
+        if (c == ']' && --depth == 0) break;
+        if (!depth) break;
+    }
+    return text;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef BRAINFUCK_TAPE_H
+#define BRAINFUCK_TAPE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The memory of the programs, in an mmap()ed region instead of a
+// fixed array, so that it needs no bounds checks:
+//
+//   | guard | padding | cells ...       | reserved ...         | guard |
+//           ^         ^begin()          ^end()
+//
+// A big range of address space is reserved with no permissions, and
+// only the first part is made readable/writable. Going past end()
+// raises SIGSEGV, and the handler installed below makes more of the
+// reservation accessible and lets the faulting instruction run again,
+// so the tape grows to the right on demand without moving (pointers
+// to the cells, like the one the JIT keeps in %rdi, stay valid).
+// Going below the first cell, or past the end of the reservation,
+// hits one of the guards, and ends the program with an error instead
+// of corrupting the process.
+//
+// The padding before the first cell is accessible too, since some
+// operations touch cells left of the tape even when the program never
+// goes there: the vectorized scans may read a vector before noticing
+// a zero (see scan.h), and a MulAdd adds to its target cell even if
+// the loop it comes from wouldn't have run (adding zero, though).
+class TooManyTapes: public std::exception {
+    virtual const char* what() const throw() {
+        return "Too many tapes";
+    }
+};
+
+class Tape
+{
+public:
+    static const size_t Padding = 4096;
+    static const size_t GuardSize = 1 << 20;
+    static const size_t DefaultReserve = size_t(1) << 30;
+    // (live at once, in the whole process: creating one more throws
+    // TooManyTapes)
+    static const size_t MaxTapes = 256;
+
+    Tape(size_t size, size_t reserve = DefaultReserve) {
+        const size_t page = page_size();
+
+        reserve = round_up(std::max(reserve, Padding + size), page);
+        size_ = 2 * GuardSize + reserve;
+
+        base_ = (uint8_t*) mmap(
+            0,
+            size_,
+            PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1,
+            0
+        );
+        if (base_ == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+
+        start_ = base_ + GuardSize;
+        limit_ = start_ + reserve;
+        end_ = start_;
+
+        commit(start_ + round_up(Padding + size, page));
+        if (!register_tape()) {
+            munmap(base_, size_);
+            throw TooManyTapes();
+        }
+    }
+
+    ~Tape() {
+        unregister_tape();
+        if (munmap(base_, size_) == -1) {
+            perror("munmap");
+            exit(1);
+        }
+    }
+
+    Tape(const Tape&) = delete;
+    Tape& operator=(const Tape&) = delete;
+
+    uint8_t* begin() const {return start_ + Padding;}
+    uint8_t* end() const {return end_;}
+
+    template <typename T> T* begin() const {return (T*) begin();}
+    template <typename T> T* end() const {return (T*) end();}
+
+    // Runs 'f' (which runs a program), and returns false if the program
+    // goes out of its tape, instead of ending the whole process. Only
+    // the thread that calls this is affected, so a server can keep
+    // going when one of its programs fails. 'f' is left with a jump
+    // out of the signal handler, so it must not own anything (the
+    // tape and the I/O context must be created outside of it):
+    template <typename F> static bool recover(F&& f) {
+        sigjmp_buf env;
+        sigjmp_buf* previous = recovery();
+        if (sigsetjmp(env, 1)) {
+            recovery() = previous;
+            return false;
+        }
+        recovery() = &env;
+        f();
+        recovery() = previous;
+        return true;
+    }
+
+    // Makes the recover() the current thread is running return false
+    // right away. Meant for signal handlers (to stop a program that
+    // runs for too long), and does nothing outside of recover():
+    static void interrupt() {
+        if (sigjmp_buf* env = recovery()) siglongjmp(*env, 1);
+    }
+
+private:
+    uint8_t *base_,    // start of the reservation (left guard)
+            *start_,   // start of the accessible region
+            *end_,     // end of the accessible region
+            *limit_;   // start of the right guard
+    size_t size_;
+
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    static size_t round_up(size_t size, size_t page) {
+        return (size + page - 1) & ~(page - 1);
+    }
+
+    bool commit(uint8_t* end) {
+        if (mprotect(end_, end - end_, PROT_READ | PROT_WRITE) == -1) {
+            return false;
+        }
+        end_ = end;
+        return true;
+    }
+
+    // Called from the signal handler, so it only uses async-signal-safe
+    // calls (mprotect() isn't formally in the list, but it's just a
+    // syscall). Returns false if the address isn't in this tape:
+    bool handle_fault(uint8_t* address) {
+        if (address < base_ || address >= base_ + size_) {
+            return false;
+        }
+
+        if (address >= end_ && address < limit_) {
+            // Double the tape, or more if the access is further away:
+            size_t size = std::max(end_ - start_, address + 1 - end_);
+            uint8_t* end = end_ + round_up(size, page_size());
+            if (end > limit_) end = limit_;
+            if (commit(end)) return true;
+        }
+
+        fail(address < start_ ? "Error: tape underflow\n"
+                              : "Error: tape overflow\n");
+        return true;
+    }
+
+    static void fail(const char* message) {
+        size_t length = 0;
+        while (message[length]) ++length;
+        if (write(STDERR_FILENO, message, length) < 0) {}
+        if (sigjmp_buf* env = recovery()) siglongjmp(*env, 1);
+        _exit(1);
+    }
+
+    // (set by recover() for the current thread)
+    static sigjmp_buf*& recovery() {
+        static thread_local sigjmp_buf* env = nullptr;
+        return env;
+    }
+
+    // The handler is process-wide, so it looks for the faulting address
+    // in all the live tapes:
+    static std::atomic<Tape*>* registry() {
+        static std::atomic<Tape*> tapes[MaxTapes];
+        return tapes;
+    }
+
+    bool register_tape() {
+        static const bool installed = install_handler();
+        (void) installed;
+
+        for (size_t i = 0; i < MaxTapes; ++i) {
+            Tape* empty = nullptr;
+            if (registry()[i].compare_exchange_strong(empty, this)) return true;
+        }
+        return false;
+    }
+
+    void unregister_tape() {
+        for (size_t i = 0; i < MaxTapes; ++i) {
+            Tape* self = this;
+            if (registry()[i].compare_exchange_strong(self, nullptr)) return;
+        }
+    }
+
+    static void handle_signal(int signal, siginfo_t* info, void*) {
+        uint8_t* address = (uint8_t*) info->si_addr;
+
+        for (size_t i = 0; i < MaxTapes; ++i) {
+            Tape* tape = registry()[i].load();
+            if (tape && tape->handle_fault(address)) return;
+        }
+
+        // Not a tape access: fault again with the default action
+        struct sigaction action = {};
+        action.sa_handler = SIG_DFL;
+        sigaction(signal, &action, nullptr);
+    }
+
+    // macOS reports accesses to PROT_NONE pages as SIGBUS:
+    static bool install_handler() {
+        struct sigaction action = {};
+        action.sa_sigaction = handle_signal;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+
+        sigaction(SIGSEGV, &action, nullptr);
+        sigaction(SIGBUS, &action, nullptr);
+        return true;
+    }
+};
+
+#endif
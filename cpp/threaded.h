@@ -0,0 +1,194 @@
+#ifndef BRAINFUCK_THREADED_H
+#define BRAINFUCK_THREADED_H
+
+#include <vector>
+
+#include "brainfuck.h"
+
+// A flat version of the expression tree: every node becomes one
+// fixed-size instruction in a contiguous array, loops become a pair
+// of conditional jumps with precomputed targets, so running it needs
+// no recursion and no virtual calls.
+enum class Opcode {
+    Add,            // cell[at] += arg
+    Move,           // ptr += arg
+    Input,          // cell[at] = next input byte
+    Output,         // write cell[at]
+    JumpIfZero,     // ptr += at; if cell[0] == 0: pc = arg
+    JumpIfNotZero,  // ptr += at; if cell[0] != 0: pc = arg
+    SetZero,        // cell[at] = 0
+    ScanLeft,       // while cell[0]: ptr -= arg
+    ScanRight,      // while cell[0]: ptr += arg
+    MulAdd,         // cell[at + offset] += cell[at] * arg
+    Halt
+};
+
+struct Instruction {
+    // Filled in by run() with the address of the label that handles
+    // 'op', so dispatching is a single indirect jump:
+    const void* handler;
+    Opcode op;
+    int32_t arg;
+    int32_t at;
+    int32_t offset;
+};
+
+using Bytecode = std::vector<Instruction>;
+
+class BytecodeCompiler : public ExpressionVisitor
+{
+private:
+    Bytecode code_;
+
+    void emit(Opcode op, ssize_t arg=0, ssize_t at=0, ssize_t offset=0) {
+        code_.push_back(Instruction{
+            nullptr, op, (int32_t)arg, (int32_t)at, (int32_t)offset
+        });
+    }
+
+public:
+    BytecodeCompiler() = default;
+    ~BytecodeCompiler() = default;
+
+    virtual void visit(const Increment& inc) {emit(Opcode::Add, inc.offset(), inc.at());}
+    virtual void visit(const Decrement& dec) {emit(Opcode::Add, -dec.offset(), dec.at());}
+    virtual void visit(const Forward& fwd)   {emit(Opcode::Move, fwd.offset());}
+    virtual void visit(const Backward& bwd)  {emit(Opcode::Move, -bwd.offset());}
+    virtual void visit(const Input& input)   {emit(Opcode::Input, 0, input.at());}
+    virtual void visit(const Output& output) {emit(Opcode::Output, 0, output.at());}
+    virtual void visit(const SetZero& zero)  {emit(Opcode::SetZero, 0, zero.at());}
+    virtual void visit(const ScanLeft& scan) {emit(Opcode::ScanLeft, scan.stride());}
+    virtual void visit(const ScanRight& scan){emit(Opcode::ScanRight, scan.stride());}
+
+    virtual void visit(const MulAdd& muladd) {
+        emit(Opcode::MulAdd, muladd.factor(), muladd.at(), muladd.offset());
+    }
+
+    // The offset folder leaves a single Move right before every loop
+    // boundary, so it's merged into the jump. The jump takes the place
+    // of the Move in the array, so jump targets already pointing there
+    // stay valid:
+    void emit_jump(Opcode op, ssize_t target=0) {
+        ssize_t move = 0;
+        if (!code_.empty() && code_.back().op == Opcode::Move) {
+            move = code_.back().arg;
+            code_.pop_back();
+        }
+        emit(op, target, move);
+    }
+
+    virtual void visit(const Loop& loop) {
+        // Both jumps land right after the other end of the loop:
+        emit_jump(Opcode::JumpIfZero);
+        size_t start = code_.size() - 1;
+
+        for(const auto &child: loop.children()) {
+            child->accept(*this);
+        }
+
+        emit_jump(Opcode::JumpIfNotZero, start + 1);
+        code_[start].arg = code_.size();
+    }
+
+    Bytecode compile(const ExpressionList& expressions) {
+        code_.clear();
+
+        for(const auto &expression: expressions) {
+            expression->accept(*this);
+        }
+        emit(Opcode::Halt);
+
+        return std::move(code_);
+    }
+};
+
+// Direct-threaded interpreter: each handler ends by jumping straight
+// to the handler of the next instruction (using GCC/Clang's labels as
+// values), so there is no central dispatch loop and every handler has
+// its own branch prediction history.
+class ThreadedRunner
+{
+private:
+    IOContext io_;
+
+public:
+    ThreadedRunner(IOPolicy policy = IOPolicy(),
+                   int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO)
+     : io_(policy, in_fd, out_fd) {}
+    ~ThreadedRunner() = default;
+
+    template <typename T>
+    void run(Bytecode& code, const Prefix& prefix = Prefix()) {
+        static const void* handlers[] = {
+            &&op_add, &&op_move, &&op_input, &&op_output,
+            &&op_jump_if_zero, &&op_jump_if_not_zero,
+            &&op_set_zero, &&op_scan_left, &&op_scan_right,
+            &&op_muladd, &&op_halt
+        };
+
+        for (auto &instruction: code) {
+            instruction.handler = handlers[static_cast<int>(instruction.op)];
+        }
+
+        // The tape pointer is a local (instead of going through
+        // Memory), so it can live in a register across handlers:
+        Tape tape(30000 * sizeof(T));
+        T* ptr = prefix.restore(tape.begin<T>());
+        io_.write(prefix.output.data(), prefix.output.size());
+
+        const Instruction* base = code.data();
+        const Instruction* pc = base;
+
+        #define DISPATCH() goto *pc->handler
+        #define NEXT() do { ++pc; DISPATCH(); } while(0)
+
+        DISPATCH();
+
+        op_add:
+            ptr[pc->at] += pc->arg;
+            NEXT();
+        op_move:
+            ptr += pc->arg;
+            NEXT();
+        op_input: {
+            int c;
+            try {
+                if (io_.read(c))
+                    ptr[pc->at] = c;
+            } catch (const EndOfInput&) {
+                goto op_halt;
+            }
+            NEXT();
+        }
+        op_output:
+            io_.write(ptr[pc->at]);
+            NEXT();
+        op_jump_if_zero:
+            ptr += pc->at;
+            pc = *ptr ? pc + 1 : base + pc->arg;
+            DISPATCH();
+        op_jump_if_not_zero:
+            ptr += pc->at;
+            pc = *ptr ? base + pc->arg : pc + 1;
+            DISPATCH();
+        op_set_zero:
+            ptr[pc->at] = 0;
+            NEXT();
+        op_scan_left:
+            ptr = scan_bwd(ptr, tape.begin<T>(), pc->arg);
+            NEXT();
+        op_scan_right:
+            ptr = scan_fwd(ptr, tape.end<T>(), pc->arg);
+            NEXT();
+        op_muladd:
+            ptr[pc->at + pc->offset] += uint32_t(ptr[pc->at]) * uint32_t(pc->arg);
+            NEXT();
+        op_halt:
+            return;
+
+        #undef NEXT
+        #undef DISPATCH
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef BRAINFUCK_TIERED_H
+#define BRAINFUCK_TIERED_H
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "brainfuck.h"
+#include "jit.h"
+
+// Interprets the tree like the OOP version, counting how many times
+// each loop is entered and iterated. Once a loop gets hot it's compiled
+// with the JIT, and the next time the program gets to it, it runs the
+// native code instead. Both work on the same tape and I/O buffers, so
+// switching is just a call. Programs that end quickly never pay for
+// compiling anything, and the ones that spend their time in loops
+// still end up running native code.
+template <typename T>
+class TieredRunner : public ExpressionVisitor
+{
+private:
+    struct LoopProfile {
+        size_t count = 0;                   // entries + iterations
+        JITProgram::Code code = nullptr;    // once compiled
+    };
+
+    IOContext io_;
+    size_t threshold_;
+    bool avx2_;
+    JITTuning tuning_;
+    Tape tape_;
+    T* ptr_;
+
+    std::unordered_map<const Loop*, LoopProfile> profiles_;
+    std::vector<std::unique_ptr<ExecutableBuffer>> buffers_;
+
+    void compile(const Loop& loop, LoopProfile& profile) {
+        buffers_.emplace_back(new ExecutableBuffer(JITCompiler::code_size(loop)));
+        JITProgram program(*buffers_.back(), NativeABI, sizeof(T), io_.policy());
+        JITCompiler(program, avx2_, tuning_).compile(loop);
+        profile.code = program.code();
+    }
+
+public:
+    TieredRunner(IOPolicy policy, size_t threshold, bool avx2, JITTuning tuning,
+                 int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO)
+      : io_(policy, in_fd, out_fd),
+        threshold_(threshold),
+        avx2_(avx2),
+        tuning_(tuning),
+        tape_(30000 * sizeof(T)),
+        ptr_(tape_.begin<T>()) {}
+
+    ~TieredRunner() = default;
+
+    virtual void visit(const Increment& inc) {ptr_[inc.at()] += inc.offset();}
+    virtual void visit(const Decrement& dec) {ptr_[dec.at()] -= dec.offset();}
+    virtual void visit(const Forward& fwd)   {ptr_ += fwd.offset();}
+    virtual void visit(const Backward& bwd)  {ptr_ -= bwd.offset();}
+    virtual void visit(const Output& output) {io_.write(ptr_[output.at()]);}
+    virtual void visit(const SetZero& zero)  {ptr_[zero.at()] = 0;}
+
+    virtual void visit(const Input& input) {
+        int c;
+        if (io_.read(c))
+            ptr_[input.at()] = c;
+    }
+
+    virtual void visit(const ScanLeft& scan) {
+        ptr_ = scan_bwd(ptr_, tape_.begin<T>(), scan.stride());
+    }
+
+    virtual void visit(const ScanRight& scan) {
+        ptr_ = scan_fwd(ptr_, tape_.end<T>(), scan.stride());
+    }
+
+    virtual void visit(const MulAdd& muladd) {
+        ptr_[muladd.at() + muladd.offset()] +=
+            uint32_t(ptr_[muladd.at()]) * uint32_t(muladd.factor());
+    }
+
+    virtual void visit(const Loop& loop) {
+        // (references to the elements of an unordered_map stay valid
+        // while the nested loops add theirs)
+        LoopProfile& profile = profiles_[&loop];
+
+        if (!profile.code && profile.count >= threshold_) {
+            compile(loop, profile);
+        }
+
+        if (profile.code) {
+            uint8_t* ptr = profile.code((uint8_t*) ptr_, io_.buffers());
+            if (!ptr) throw EndOfInput();
+            ptr_ = (T*) ptr;
+            return;
+        }
+
+        size_t count = 1;
+        while (*ptr_) {
+            for(const auto &child: loop.children()) {
+                child->accept(*this);
+            }
+            ++count;
+        }
+        profile.count += count;
+    }
+
+    void run(const ExpressionList& expressions, const Prefix& prefix) {
+        io_.write(prefix.output.data(), prefix.output.size());
+        ptr_ = prefix.restore(tape_.begin<T>());
+
+        try {
+            for(const auto &expression: expressions) {
+                expression->accept(*this);
+            }
+        } catch (const EndOfInput&) {
+            // The input is over, and so is the program
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,570 @@
+#ifndef BRAINFUCK_X86_H
+#define BRAINFUCK_X86_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Wraps an mmap()ed area, which starts with read/write permissions,
+// but that can be later turned into read/exec before execution.
+// This is good practice since the pages are never writable AND executable
+// _at the same_time_
+// (See https://eli.thegreenplace.net/2013/11/05/how-to-jit-an-introduction)
+class ExecutableBuffer
+{
+private:
+    uint8_t *buf_,
+            *ptr_;
+    size_t size_;
+
+public:
+    ExecutableBuffer(size_t size) {
+        size_ = size;
+        buf_ = (uint8_t*) mmap(
+            0,
+            size_,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0
+        );
+        if (buf_ == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        ptr_ = buf_;
+        memset(ptr_, 0x00, size);
+    }
+
+    ~ExecutableBuffer() {
+        if(munmap(buf_, size_) == -1) {
+            perror("munmap");
+            exit(1);
+        }
+    }
+
+    void make_executable() {
+        if (mprotect(buf_, size_, PROT_READ | PROT_EXEC) == -1) {
+            perror("mprotect");
+            exit(1);
+        }
+    }
+
+    uint8_t* get_base () const { return buf_; }
+    uint8_t* get_ptr () const { return ptr_; }
+    void set_ptr (uint8_t* ptr) { ptr_ = ptr; }
+
+    void writeb(uint8_t byte) {
+        // write a single byte
+        check(1);
+        (*ptr_++) = byte;
+    }
+
+    void writew(uint16_t value) {
+        // write a 2-bytes word, keeping endianness
+        writes((uint8_t*)&value, 2);
+    }
+
+    void writel(uint32_t value) {
+        // write a 4-bytes word, keeping endianness
+        writes((uint8_t*)&value, 4);
+    }
+
+    void writeq(uint64_t value) {
+        // write an 8-bytes word, keeping endianness
+        writes((uint8_t*)&value, 8);
+    }
+
+    void writes(const uint8_t* bytes, uint32_t size) {
+        // write an arbitrary-length series of bytes
+        check(size);
+        memcpy(ptr_, bytes, size);
+        ptr_ += size;
+    }
+
+    void writerel(const uint8_t* target) {
+        // write the 4-bytes displacement from the end of the operand
+        // to 'target' (for relative calls and jumps)
+        writel(target - (ptr_ + 4));
+    }
+
+private:
+    void check(size_t size) const {
+        // the buffer is sized with JITCompiler::code_size(), so
+        // this is a bug, but better to know than to overflow:
+        if (ptr_ + size > buf_ + size_) {
+            fputs("Error: the generated code doesn't fit\n", stderr);
+            exit(1);
+        }
+    }
+};
+
+// A small x86-64 assembler, with just what the JIT needs: it takes
+// typed registers and memory operands (in Intel order: destination
+// first) and picks the shortest encoding for each instruction (disp8
+// vs disp32, imm8 vs imm32, rel8 vs rel32 for jumps that are already
+// known to be close), so the compiler never deals with opcode bytes.
+namespace x86 {
+
+// General purpose registers carry their size (1, 2, 4 or 8 bytes), so
+// the same id can be %al, %ax, %eax or %rax. Vector ones are 16 (xmm)
+// or 32 (ymm) bytes:
+struct Reg {
+    uint8_t id;
+    uint8_t size;
+
+    constexpr Reg sized(uint8_t size) const {return Reg{id, size};}
+};
+
+constexpr Reg rax{0, 8}, rcx{1, 8}, rdx{2, 8}, rbx{3, 8},
+              rsp{4, 8}, rbp{5, 8}, rsi{6, 8}, rdi{7, 8},
+              r8{8, 8}, r9{9, 8}, r10{10, 8}, r11{11, 8};
+
+constexpr Reg eax = rax.sized(4), ecx = rcx.sized(4), edx = rdx.sized(4),
+              esi = rsi.sized(4), edi = rdi.sized(4),
+              r9d = r9.sized(4), r10d = r10.sized(4);
+
+constexpr Reg al = rax.sized(1), cl = rcx.sized(1);
+
+constexpr Reg xmm0{0, 16}, xmm1{1, 16}, ymm0{0, 32}, ymm1{1, 32};
+
+// [base + index + disp], with 'size' bytes at that address. A base
+// of NoBase means it's relative to the next instruction (%rip):
+struct Mem {
+    static const uint8_t NoBase = 0xff;
+    static const uint8_t NoIndex = 0xff;
+
+    uint8_t size;
+    uint8_t base;
+    uint8_t index;
+    int32_t disp;
+};
+
+inline Mem ptr(uint8_t size, Reg base, int32_t disp = 0) {
+    return Mem{size, base.id, Mem::NoIndex, disp};
+}
+
+inline Mem ptr(uint8_t size, Reg base, Reg index, int32_t disp = 0) {
+    return Mem{size, base.id, index.id, disp};
+}
+
+inline Mem rip_ptr(uint8_t size, int32_t disp) {
+    return Mem{size, Mem::NoBase, Mem::NoIndex, disp};
+}
+
+inline Mem byte_ptr(Reg base, int32_t disp = 0) {return ptr(1, base, disp);}
+inline Mem qword_ptr(Reg base, int32_t disp = 0) {return ptr(8, base, disp);}
+
+inline Mem byte_ptr(Reg base, Reg index, int32_t disp = 0) {
+    return ptr(1, base, index, disp);
+}
+
+// Condition codes, as encoded in jcc:
+enum class Cond : uint8_t {
+    B = 0x2, AE = 0x3, E = 0x4, NE = 0x5,
+    S = 0x8, NS = 0x9, LE = 0xe, G = 0xf,
+};
+
+// Jumps to labels that aren't bound yet need to know how far they
+// go: Short ones take a rel8, and it's an error if the label ends up
+// further away. Jumps back to bound labels always take the shortest:
+enum class Distance {
+    Short,
+    Near,
+};
+
+// A position in the code, which jumps and calls can target before
+// it's known (they are patched when the label gets bound):
+class Label
+{
+private:
+    friend class Assembler;
+
+    struct Fixup {
+        uint8_t* at;    // displacement to patch
+        bool short_;    // rel8, or rel32
+    };
+
+    uint8_t* target_ = nullptr;
+    std::vector<Fixup> fixups_;
+
+public:
+    bool bound() const {return target_ != nullptr;}
+    uint8_t* target() const {return target_;}
+};
+
+class Assembler
+{
+private:
+    ExecutableBuffer& buf_;
+
+    enum Alu : uint8_t {
+        AluAdd = 0, AluOr = 1, AluAnd = 4, AluSub = 5, AluXor = 6, AluCmp = 7,
+    };
+
+    static bool is_int8(int64_t value) {return value >= -128 && value <= 127;}
+
+    // The operand in ModRM.rm, either a register or a memory operand:
+    struct RM {
+        bool is_reg;
+        Reg reg;
+        Mem mem;
+
+        RM(Reg r) : is_reg(true), reg(r), mem() {}
+        RM(const Mem& m) : is_reg(false), reg(), mem(m) {}
+
+        uint8_t size() const {return is_reg ? reg.size : mem.size;}
+    };
+
+    // REX prefix (if needed): W for 64-bit operands, and the 4th bit
+    // of the registers in ModRM.reg, SIB.index and ModRM.rm/SIB.base.
+    // Byte operations on %spl, %bpl, %sil and %dil need one as well,
+    // otherwise the same ids mean %ah, %ch, %dh and %bh:
+    void rex(bool w, uint8_t reg, const RM& rm, bool byte_regs) {
+        uint8_t prefix = 0x40 | (w ? 8 : 0) | ((reg >> 1) & 4);
+        if (rm.is_reg) {
+            prefix |= rm.reg.id >> 3;
+        } else {
+            if (rm.mem.index != Mem::NoIndex) prefix |= (rm.mem.index >> 2) & 2;
+            if (rm.mem.base != Mem::NoBase) prefix |= rm.mem.base >> 3;
+        }
+        if (prefix != 0x40 || byte_regs) buf_.writeb(prefix);
+    }
+
+    // ModRM, SIB and displacement:
+    void modrm(uint8_t reg, const RM& rm) {
+        reg &= 7;
+        if (rm.is_reg) {
+            buf_.writeb(0xc0 | (reg << 3) | (rm.reg.id & 7));
+            return;
+        }
+
+        const Mem& m = rm.mem;
+        if (m.base == Mem::NoBase) {
+            buf_.writeb((reg << 3) | 5);
+            buf_.writel(m.disp);
+            return;
+        }
+
+        // %rbp and %r13 as base always take a displacement, and %rsp
+        // and %r12 need a SIB byte:
+        uint8_t mod = (m.disp == 0 && (m.base & 7) != 5) ? 0 :
+                      is_int8(m.disp) ? 1 : 2;
+        if (m.index != Mem::NoIndex || (m.base & 7) == 4) {
+            uint8_t index = m.index != Mem::NoIndex ? (m.index & 7) : 4;
+            buf_.writeb((mod << 6) | (reg << 3) | 4);
+            buf_.writeb((index << 3) | (m.base & 7));
+        } else {
+            buf_.writeb((mod << 6) | (reg << 3) | (m.base & 7));
+        }
+
+        if (mod == 1) buf_.writeb(m.disp);
+        if (mod == 2) buf_.writel(m.disp);
+    }
+
+    // A whole instruction on general purpose operands of 'size' bytes.
+    // 'opcode' is the one for 16/32/64 bits, and byte operations use
+    // the one before it (addb is 0x00 while addl is 0x01, movb is 0x88
+    // while movl is 0x89, and so on), unless 'sized' is false:
+    void op(uint8_t size, uint8_t opcode, uint8_t reg, const RM& rm,
+            bool byte_regs = false, bool sized = true) {
+        if (size == 2) buf_.writeb(0x66);
+        rex(size == 8, reg, rm, byte_regs);
+        buf_.writeb(size == 1 && sized ? opcode - 1 : opcode);
+        modrm(reg, rm);
+    }
+
+    // Same with a two-byte (0x0f-prefixed) opcode:
+    void op0f(uint8_t size, uint8_t opcode, uint8_t reg, const RM& rm) {
+        if (size == 2) buf_.writeb(0x66);
+        rex(size == 8, reg, rm, false);
+        buf_.writeb(0x0f);
+        buf_.writeb(opcode);
+        modrm(reg, rm);
+    }
+
+    static bool byte_reg(Reg reg) {return reg.size == 1 && reg.id >= 4;}
+
+    void immediate(uint8_t size, int64_t value) {
+        switch (size) {
+            case 1: buf_.writeb(value); break;
+            case 2: buf_.writew(value); break;
+            default: buf_.writel(value); break;
+        }
+    }
+
+    void alu(Alu alu, const RM& dst, int32_t imm) {
+        uint8_t size = dst.size();
+        if (size == 1) {
+            op(1, 0x80, alu, dst, dst.is_reg && byte_reg(dst.reg), false);
+            buf_.writeb(imm);
+        } else if (is_int8(imm)) {
+            op(size, 0x83, alu, dst);
+            buf_.writeb(imm);
+        } else if (dst.is_reg && dst.reg.id == 0) {
+            // (short form for %ax, %eax and %rax)
+            if (size == 2) buf_.writeb(0x66);
+            if (size == 8) buf_.writeb(0x48);
+            buf_.writeb(alu * 8 + 5);
+            immediate(size, imm);
+        } else {
+            op(size, 0x81, alu, dst);
+            immediate(size, imm);
+        }
+    }
+
+    void alu(Alu alu, const RM& dst, Reg src) {
+        op(src.size, alu * 8 + 1, src.id, dst,
+           byte_reg(src) || (dst.is_reg && byte_reg(dst.reg)));
+    }
+
+    void alu(Alu alu, Reg dst, const Mem& src) {
+        op(dst.size, alu * 8 + 3, dst.id, src, byte_reg(dst));
+    }
+
+    void vex(uint8_t pp, bool l, uint8_t reg, uint8_t vvvv, const RM& rm) {
+        uint8_t x = !rm.is_reg && rm.mem.index != Mem::NoIndex ? rm.mem.index >> 3 : 0;
+        uint8_t b = rm.is_reg ? rm.reg.id >> 3 :
+                    rm.mem.base != Mem::NoBase ? rm.mem.base >> 3 : 0;
+        uint8_t r = reg >> 3;
+        uint8_t tail = ((~vvvv & 15) << 3) | (l ? 4 : 0) | pp;
+        if (!x && !b) {
+            buf_.writeb(0xc5);
+            buf_.writeb((r ? 0 : 0x80) | tail);
+        } else {
+            buf_.writeb(0xc4);
+            buf_.writeb((r ? 0 : 0x80) | (x ? 0 : 0x40) | (b ? 0 : 0x20) | 1);
+            buf_.writeb(tail);
+        }
+    }
+
+    // SSE2 (66/f3 0f xx) and AVX2 (VEX.66/f3.0f xx) instructions:
+    void sse(uint8_t prefix, uint8_t opcode, uint8_t reg, const RM& rm) {
+        buf_.writeb(prefix);
+        rex(false, reg, rm, false);
+        buf_.writeb(0x0f);
+        buf_.writeb(opcode);
+        modrm(reg, rm);
+    }
+
+    void avx(uint8_t pp, uint8_t opcode, uint8_t reg, uint8_t vvvv, const RM& rm) {
+        vex(pp, true, reg, vvvv, rm);
+        buf_.writeb(opcode);
+        modrm(reg, rm);
+    }
+
+    void jump(uint8_t short_opcode, const uint8_t* near_opcode, size_t near_size,
+              Label& label, Distance distance) {
+        if (label.bound()) {
+            int64_t rel = label.target_ - (buf_.get_ptr() + 2);
+            if (is_int8(rel)) {
+                buf_.writeb(short_opcode);
+                buf_.writeb(rel);
+            } else {
+                buf_.writes(near_opcode, near_size);
+                buf_.writerel(label.target_);
+            }
+        } else if (distance == Distance::Short) {
+            buf_.writeb(short_opcode);
+            label.fixups_.push_back(Label::Fixup{buf_.get_ptr(), true});
+            buf_.writeb(0);
+        } else {
+            buf_.writes(near_opcode, near_size);
+            label.fixups_.push_back(Label::Fixup{buf_.get_ptr(), false});
+            buf_.writel(0);
+        }
+    }
+
+public:
+    explicit Assembler(ExecutableBuffer& buf) : buf_(buf) {}
+
+    uint8_t* here() const {return buf_.get_ptr();}
+
+    // Pads with NOPs up to the next multiple of 'alignment' (a power of
+    // 2), using the multi-byte forms so they decode as few instructions:
+    void align(size_t alignment) {
+        static const uint8_t nops[][9] = {
+            {0x90},
+            {0x66, 0x90},
+            {0x0f, 0x1f, 0x00},
+            {0x0f, 0x1f, 0x40, 0x00},
+            {0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+            {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        };
+
+        size_t padding = -(uintptr_t) buf_.get_ptr() & (alignment - 1);
+        while (padding > 0) {
+            size_t size = padding < 9 ? padding : 9;
+            buf_.writes(nops[size - 1], size);
+            padding -= size;
+        }
+    }
+
+    void bind(Label& label) {
+        label.target_ = buf_.get_ptr();
+        for (const auto& fixup: label.fixups_) {
+            int64_t rel = label.target_ - (fixup.at + (fixup.short_ ? 1 : 4));
+            if (fixup.short_) {
+                if (!is_int8(rel)) {
+                    fputs("Error: short jump out of range\n", stderr);
+                    exit(1);
+                }
+                *fixup.at = rel;
+            } else {
+                int32_t rel32 = rel;
+                memcpy(fixup.at, &rel32, 4);
+            }
+        }
+        label.fixups_.clear();
+    }
+
+    // Data movement:
+    void mov(Reg dst, Reg src) {op(src.size, 0x89, src.id, dst, byte_reg(src) || byte_reg(dst));}
+    void mov(const Mem& dst, Reg src) {op(src.size, 0x89, src.id, dst, byte_reg(src));}
+    void mov(Reg dst, const Mem& src) {op(dst.size, 0x8b, dst.id, src, byte_reg(dst));}
+
+    void mov(Reg dst, int64_t imm) {
+        if (dst.size == 8 && !(imm >= 0 && imm <= 0xffffffff)) {
+            if (imm >= INT32_MIN && imm <= INT32_MAX) {
+                op(8, 0xc7, 0, dst);        // sign-extended imm32
+                buf_.writel(imm);
+            } else {
+                rex(true, 0, dst, false);   // movabs
+                buf_.writeb(0xb8 | (dst.id & 7));
+                buf_.writeq(imm);
+            }
+            return;
+        }
+        // (writing a 32-bit register clears the upper half)
+        uint8_t size = dst.size == 8 ? 4 : dst.size;
+        if (size == 2) buf_.writeb(0x66);
+        rex(false, 0, dst, byte_reg(dst));
+        buf_.writeb((size == 1 ? 0xb0 : 0xb8) | (dst.id & 7));
+        immediate(size, imm);
+    }
+
+    void mov(const Mem& dst, int32_t imm) {
+        op(dst.size, 0xc7, 0, dst);
+        immediate(dst.size == 8 ? 4 : dst.size, imm);
+    }
+
+    // Loads 'src' zero-extended (movzbl, movzwl, or a plain movl):
+    void movzx(Reg dst, const Mem& src) {
+        if (src.size == 4) {
+            mov(dst.sized(4), src);
+        } else {
+            op0f(dst.size == 8 ? 8 : 4, src.size == 1 ? 0xb6 : 0xb7, dst.id, src);
+        }
+    }
+
+    void lea(Reg dst, const Mem& src) {op(dst.size, 0x8d, dst.id, src);}
+
+    // The address of a (bound) label, relative to %rip:
+    void lea(Reg dst, const Label& label) {
+        lea(dst, rip_ptr(8, 0));
+        int32_t rel = label.target_ - buf_.get_ptr();
+        memcpy(buf_.get_ptr() - 4, &rel, 4);
+    }
+
+    // Raw bytes (data in the middle of the code):
+    void bytes(const void* data, size_t size) {buf_.writes((const uint8_t*) data, size);}
+
+    void push(Reg reg) {
+        if (reg.id >= 8) buf_.writeb(0x41);
+        buf_.writeb(0x50 | (reg.id & 7));
+    }
+
+    void pop(Reg reg) {
+        if (reg.id >= 8) buf_.writeb(0x41);
+        buf_.writeb(0x58 | (reg.id & 7));
+    }
+
+    // Arithmetic, with a register, memory or immediate source:
+    template <typename D, typename S> void add(const D& dst, const S& src) {alu(AluAdd, dst, src);}
+    template <typename D, typename S> void or_(const D& dst, const S& src) {alu(AluOr, dst, src);}
+    template <typename D, typename S> void and_(const D& dst, const S& src) {alu(AluAnd, dst, src);}
+    template <typename D, typename S> void sub(const D& dst, const S& src) {alu(AluSub, dst, src);}
+    template <typename D, typename S> void xor_(const D& dst, const S& src) {alu(AluXor, dst, src);}
+    template <typename D, typename S> void cmp(const D& dst, const S& src) {alu(AluCmp, dst, src);}
+
+    void test(Reg dst, Reg src) {op(src.size, 0x85, src.id, dst, byte_reg(src) || byte_reg(dst));}
+
+    void inc(Reg reg) {op(reg.size, 0xff, 0, reg, byte_reg(reg));}
+    void dec(Reg reg) {op(reg.size, 0xff, 1, reg, byte_reg(reg));}
+    void inc(const Mem& mem) {op(mem.size, 0xff, 0, mem);}
+    void dec(const Mem& mem) {op(mem.size, 0xff, 1, mem);}
+
+    void imul(Reg dst, Reg src, int32_t imm) {
+        if (is_int8(imm)) {
+            op(dst.size, 0x6b, dst.id, src, false, false);
+            buf_.writeb(imm);
+        } else {
+            op(dst.size, 0x69, dst.id, src, false, false);
+            immediate(dst.size, imm);
+        }
+    }
+
+    void bsf(Reg dst, Reg src) {op0f(dst.size, 0xbc, dst.id, src);}
+    void bsr(Reg dst, Reg src) {op0f(dst.size, 0xbd, dst.id, src);}
+
+    // Control flow:
+    void jmp(Label& label, Distance distance = Distance::Near) {
+        static const uint8_t opcode[] = {0xe9};
+        jump(0xeb, opcode, 1, label, distance);
+    }
+
+    void j(Cond cond, Label& label, Distance distance = Distance::Near) {
+        const uint8_t opcode[] = {0x0f, uint8_t(0x80 | uint8_t(cond))};
+        jump(0x70 | uint8_t(cond), opcode, 2, label, distance);
+    }
+
+    void call(const uint8_t* target) {
+        buf_.writeb(0xe8);
+        buf_.writerel(target);
+    }
+
+    void call(Label& label) {
+        if (label.bound()) {
+            call(label.target_);
+            return;
+        }
+        buf_.writeb(0xe8);
+        label.fixups_.push_back(Label::Fixup{buf_.get_ptr(), false});
+        buf_.writel(0);
+    }
+
+    void ret()        {buf_.writeb(0xc3);}
+    void int3()       {buf_.writeb(0xcc);}
+    void clc()        {buf_.writeb(0xf8);}
+    void stc()        {buf_.writeb(0xf9);}
+    void syscall()    {buf_.writes((uint8_t*)"\x0f\x05", 2);}
+    void vzeroupper() {buf_.writes((uint8_t*)"\xc5\xf8\x77", 3);}
+
+    // SSE2, with 'lane' the size of the compared elements (1, 2 or 4):
+    void pxor(Reg dst, Reg src)            {sse(0x66, 0xef, dst.id, src);}
+    void movdqu(Reg dst, const Mem& src)   {sse(0xf3, 0x6f, dst.id, src);}
+    void pmovmskb(Reg dst, Reg src)        {sse(0x66, 0xd7, dst.id, src);}
+    void pcmpeq(uint8_t lane, Reg dst, Reg src) {
+        sse(0x66, lane == 1 ? 0x74 : lane == 2 ? 0x75 : 0x76, dst.id, src);
+    }
+
+    // AVX2 (VEX pp: 1 is 66, 2 is f3):
+    void vpxor(Reg dst, Reg src1, Reg src2) {avx(1, 0xef, dst.id, src1.id, src2);}
+    void vmovdqu(Reg dst, const Mem& src)   {avx(2, 0x6f, dst.id, 0, src);}
+    void vpmovmskb(Reg dst, Reg src)        {avx(1, 0xd7, dst.id, 0, src);}
+    void vpcmpeq(uint8_t lane, Reg dst, Reg src1, Reg src2) {
+        avx(1, lane == 1 ? 0x74 : lane == 2 ? 0x75 : 0x76, dst.id, src1.id, src2);
+    }
+};
+
+} // namespace x86
+
+#endif